@@ -0,0 +1,31 @@
+#!/bin/sh
+# Opening a large file: the time to the first prompt with -a, which should
+# not grow with the file, against loading it all, with and without the
+# .emidx line index next to it.
+
+EM=${EM:-./em}
+LINES=${LINES:-30000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$LINES" 'BEGIN { for (i = 0; i < n; i++) printf "%07d\n", i }' > "$DIR/in.txt"
+
+BYTES=$(wc -c < "$DIR/in.txt")
+
+now() {
+    date +%s.%N
+}
+
+# q right away is the first prompt; $p waits for the last line
+T0=$(now)
+printf 'q\n' | "$EM" -a "$DIR/in.txt" > /dev/null || exit 1
+T1=$(now)
+printf '$p\nq\n' | "$EM" "$DIR/in.txt" > /dev/null || exit 1
+T2=$(now)
+printf '$p\nq\n' | "$EM" "$DIR/in.txt" > /dev/null || exit 1
+T3=$(now)
+
+awk -v t0="$T0" -v t1="$T1" -v t2="$T2" -v t3="$T3" -v b="$BYTES" -v n="$LINES" 'BEGIN {
+    printf "%d lines, %d bytes: first prompt with -a %.1fms\n", n, b, (t1 - t0) * 1e3
+    printf "whole load %.3fs, again with the index %.3fs\n", t2 - t1, t3 - t2
+}'
@@ -0,0 +1,123 @@
+/* In process against spawned: the same scripted edit of a small file,
+ * done EDITS times through libem and EDITS times by running em with the
+ * script piped in, which is what tools did before there was a library.
+ * Both write their result, and the results are compared at the end. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "em.h"
+
+#define SCRIPT "2,$s/item/entry/\n1d\n$a\nlast\n.\n10,20m0\n"
+
+extern char** environ;
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char* slurp(const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    char* text = NULL;
+    size_t len = 0;
+
+    if (fp == NULL)
+        return NULL;
+
+    getdelim(&text, &len, 0, fp);
+    fclose(fp);
+    return text;
+}
+
+int main()
+{
+    const char* em = getenv("EM") != NULL ? getenv("EM") : "./em";
+    int edits = getenv("EDITS") != NULL ? atoi(getenv("EDITS")) : 1000;
+    int lines = getenv("LINES") != NULL ? atoi(getenv("LINES")) : 1000;
+    char dir[] = "/tmp/em-bench.XXXXXX";
+    char in[64], script[64], lib_out[64], exe_out[64];
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    sprintf(in, "%s/in.txt", dir);
+    sprintf(script, "%s/script", dir);
+    sprintf(lib_out, "%s/lib.txt", dir);
+    sprintf(exe_out, "%s/exe.txt", dir);
+
+    FILE* fp = fopen(in, "w");
+    for (int i = 0; i < lines; i++)
+        fprintf(fp, "{\"id\":%d,\"name\":\"item%07d\"}\n", i, i);
+    fclose(fp);
+
+    fp = fopen(script, "w");
+    fprintf(fp, "%sw %s\nq\n", SCRIPT, exe_out);
+    fclose(fp);
+
+    double t0 = now();
+
+    for (int i = 0; i < edits; i++) {
+        em_buffer* b = em_open(in);
+
+        if (b == NULL || em_exec(b, SCRIPT) != 0 || em_write(b, lib_out) != 0) {
+            fprintf(stderr, "libem: %s\n", b != NULL ? em_error(b) : "cannot open");
+            return 1;
+        }
+        em_close(b);
+    }
+
+    double t1 = now();
+
+    for (int i = 0; i < edits; i++) {
+        posix_spawn_file_actions_t actions;
+        char* argv[] = { (char*)em, in, NULL };
+        pid_t pid;
+        int status;
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 0, script, O_RDONLY, 0);
+        posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+
+        if (posix_spawn(&pid, em, &actions, NULL, argv, environ) != 0) {
+            perror(em);
+            return 1;
+        }
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s failed\n", em);
+            return 1;
+        }
+    }
+
+    double t2 = now();
+    char* a = slurp(lib_out);
+    char* b = slurp(exe_out);
+    bool same = a != NULL && b != NULL && strcmp(a, b) == 0;
+
+    printf("%d edits of %d lines: in process %.3fs, %.0f/s\n", edits, lines, t1 - t0, edits / (t1 - t0));
+    printf("%d edits of %d lines: spawned %.3fs, %.0f/s\n", edits, lines, t2 - t1, edits / (t2 - t1));
+    printf("in process is %.1fx faster%s\n", (t2 - t1) / (t1 - t0), same ? "" : ", BUT THE OUTPUTS DIFFER");
+
+    unlink(in);
+    unlink(script);
+    unlink(lib_out);
+    unlink(exe_out);
+    rmdir(dir);
+    free(a);
+    free(b);
+    return same ? 0 : 1;
+}
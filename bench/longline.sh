@@ -0,0 +1,44 @@
+#!/bin/sh
+# Long lines: load a 100 MB minified JSON file that is a single line, then
+# time substitutions spread over it and writing it back. An edit should
+# cost about the same whatever the length of the line.
+
+EM=${EM:-./em}
+RECORDS=${RECORDS:-2500000}
+EDITS=${EDITS:-20}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$RECORDS" 'BEGIN {
+    printf "["
+    for (i = 0; i < n; i++)
+        printf "%s{\"id\":%d,\"name\":\"item%07d\"}", i ? "," : "", i, i
+    print "]"
+}' > "$DIR/in.json"
+
+awk -v n="$RECORDS" -v k="$EDITS" 'BEGIN {
+    for (i = 0; i < k; i++)
+        printf "s/\"id\":%d,/\"id\":%d,\"edited\":true,/\n", int(n / k * i), int(n / k * i)
+}' > "$DIR/edits"
+
+BYTES=$(wc -c < "$DIR/in.json")
+
+now() {
+    date +%s.%N
+}
+
+# each run loads the file, the difference between runs is what they add
+T0=$(now)
+printf 'Q\n' | "$EM" "$DIR/in.json" > /dev/null || exit 1
+T1=$(now)
+(cat "$DIR/edits"; printf 'Q\n') | "$EM" "$DIR/in.json" > /dev/null || exit 1
+T2=$(now)
+printf 'w %s\nQ\n' "$DIR/out.json" | "$EM" "$DIR/in.json" > /dev/null || exit 1
+T3=$(now)
+
+awk -v t0="$T0" -v t1="$T1" -v t2="$T2" -v t3="$T3" -v b="$BYTES" -v k="$EDITS" 'BEGIN {
+    load = t1 - t0
+    printf "1 line, %d bytes: load %.3fs, %.1f MB/s\n", b, load, b / load / 1e6
+    printf "%d substitutions: %.1fms each\n", k, (t2 - t1 - load) / k * 1e3
+    printf "write %.3fs, %.1f MB/s\n", t3 - t2 - load, b / (t3 - t2 - load) / 1e6
+}'
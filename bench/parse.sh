@@ -0,0 +1,34 @@
+#!/bin/sh
+# Parse throughput: decode a million line synthetic script with -n, which
+# runs the address/command lexer without executing anything.
+
+EM=${EM:-./em}
+LINES=${LINES:-1000000}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+    split("p n d", cmds, " ")
+    for (i = 0; i < n; i++) {
+        k = i % 8
+        c = cmds[i % 3 + 1]
+        if (k == 0) print i % 5000 + 1 c
+        else if (k == 1) print ".+" i % 17 c
+        else if (k == 2) print "$-" i % 100 ",$" c
+        else if (k == 3) print i % 300 + 1 ";+" i % 9 c
+        else if (k == 4) print ","
+        else if (k == 5) print "-" i % 3 "," "+" i % 4 " " c
+        else if (k == 6) print i % 999 + 1 "," i % 999 + 1000 c
+        else print ".-^+2" c
+    }
+}' > "$SCRIPT"
+
+BYTES=$(wc -c < "$SCRIPT")
+START=$(date +%s.%N)
+"$EM" -n < "$SCRIPT" || exit 1
+END=$(date +%s.%N)
+
+awk -v s="$START" -v e="$END" -v n="$LINES" -v b="$BYTES" 'BEGIN {
+    t = e - s
+    printf "%d lines, %d bytes in %.3fs: %.1f Mlines/s, %.1f MB/s\n", n, b, t, n / t / 1e6, b / t / 1e6
+}'
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t table[256];
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t n)
+{
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++)
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+/* eight bytes per instruction, the odd ones at either end one by one */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n)
+{
+    uint64_t c = crc;
+
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+
+    for (; n > 0; n--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+
+    return c;
+}
+
+static bool have_hw()
+{
+    static int have = -1;
+
+    if (have == -1)
+        have = __builtin_cpu_supports("sse4.2");
+    return have;
+}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n)
+{
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t v;
+
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+
+    for (; n > 0; n--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static bool have_hw()
+{
+    return true;
+}
+
+#else
+
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n)
+{
+    return crc32c_table(crc, p, n);
+}
+
+static bool have_hw()
+{
+    return false;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t n)
+{
+    crc = ~crc;
+    crc = have_hw() ? crc32c_hw(crc, data, n) : crc32c_table(crc, data, n);
+    return ~crc;
+}
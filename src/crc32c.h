@@ -0,0 +1,13 @@
+#ifndef EM_CRC32C_H
+#define EM_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), with the SSE 4.2 or ARMv8 CRC instructions when
+ * the CPU has them and a table otherwise. */
+
+/* extend crc, 0 to start, over n bytes of data */
+uint32_t crc32c(uint32_t crc, const void* data, size_t n);
+
+#endif
@@ -2,476 +2,5862 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "linenoise.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "em.h"
 
+#define READ_BLOCK (1 << 16)
+#define HISTORY_MAX 100000
+#define DIR_CACHE_SIZE 8
+#define COMPLETE_MAX 1000
+#define LINE_MAX_EDIT 4096
+#define IDLE_DELAY 100
+#define WRITE_BATCH 512
+#define INLINE_SIZE 31
+#define PACK_LINES 64
+#define PACK_STEP 16
+#define PACK_CACHE 16
+#define WRITE_ARENA (1 << 18)
+#define SPILL_PAGE (1 << 16)
+#define SPILL_CACHE 32
+#define SPILL_CHECK 4096
+#define SPILL_BATCH 1024
+#define CHUNK_SIZE (1 << 16)
+#define CHUNK_MIN (1 << 20)
+#define STREAM_SPLICE 4096
+#define STREAM_WINDOW 4096
+#define INDEX_MIN (1 << 26)
+#define INDEX_SAMPLES 16
+#define INDEX_SAMPLE 4096
+#define LOAD_BATCH 65536
+#define SAVE_BLOCK (1 << 20)
+#define JOURNAL_SPLIT (1 << 20)
+#define JOURNAL_RECORD 12
+
+#ifndef REG_STARTEND
+#define REG_STARTEND 0
+#endif
+
+enum text_kind_t {
+    T_INLINE,
+    T_SHARED,
+    T_PACKED,
+    T_SPILLED,
+    T_CHUNKED,
+    T_MAPPED,
+    T_KINDS
+};
+
+/* where a packed line sits in its compressed block */
+struct pack_ref_t {
+    struct pack_t* pack;
+    size_t offset;
+};
+
+/* where a line of a mapped file starts */
+struct map_ref_t {
+    struct map_t* map;
+    size_t offset;
+};
+
+/* Line text is stored in the node's own allocation, right after the
+ * links, so a line costs a single malloc. When interning, lines of
+ * INLINE_SIZE or more point to a shared refcounted copy instead, with -z
+ * cold lines are moved into compressed blocks, and over --mem-limit they
+ * go to the scratch file, leaving only their offset in the node. Lines
+ * of CHUNK_MIN or more are split into chunks, and lines read from a
+ * regular file point into a mapping of it until they change. */
 struct node_t {
-    char* line;
     struct node_t* prev;
     struct node_t* next;
+    size_t len : 55;
+    size_t touched : 1;
+    size_t kind : 8;
+    union {
+        char* ptr;
+        struct pack_ref_t packed;
+        off_t spilled;
+        struct rope_t* rope;
+        struct map_ref_t mapped;
+        char buf[sizeof(char*)];
+    } text;
 };
 
 typedef struct node_t node;
 
+/* one interned line, pointed to by every node with the same text */
+struct shared_t {
+    struct shared_t* next;
+    size_t len;
+    unsigned hash;
+    unsigned refs;
+    char text[];
+};
+
+typedef struct shared_t shared;
+
+/* a piece of a long line */
+struct chunk_t {
+    size_t len;
+    char data[];
+};
+
+typedef struct chunk_t chunk;
+
+/* A long line as a table of chunks of up to CHUNK_SIZE, so an edit
+ * copies a chunk or two and shifts the table instead of moving the whole
+ * text. ends[i] is the offset just past chunk i, to binary search for
+ * the chunk holding an offset. */
+struct rope_t {
+    int count;
+    int cap;
+    chunk** chunks;
+    size_t* ends;
+};
+
+typedef struct rope_t rope;
+
+/* A file mapped by e or r, unmapped with its last line. The file is
+ * checked before each command through fd; once it changed, the mapping
+ * is detached from it, made a private copy of what is there. */
+struct map_t {
+    struct map_t* next;
+    unsigned long refs;
+    char* base;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    struct timespec mtime;
+    char* path;
+};
+
+typedef struct map_t map;
+
+/* Start of the .name.emidx file kept next to a large file that was
+ * mapped, so the newlines need not be found again when it is reopened.
+ * The length of each line follows as a LEB128 varint. */
+struct index_head_t {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    // over INDEX_SAMPLES blocks spread through the file
+    uint64_t sum;
+    uint64_t lines;
+    uint64_t no_eol;
+};
+
+typedef struct index_head_t index_head;
+
+/* Start of the .name.emj journal of the edits made to name since it was
+ * read or saved, which is the file it is for. Records follow, each a
+ * 64 bit length and the CRC-32C of what follows it: an op and its
+ * operands as varints, text as a length and the bytes. */
+struct journal_head_t {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+};
+
+typedef struct journal_head_t journal_head;
+
+/* Finds the lines of a mapped file one by one, from its index or by
+ * looking for newlines, in which case it can write the index as it goes.
+ * Touches nothing else, so it can run outside the main thread. */
+struct line_scan_t {
+    map* mp;
+    size_t off;
+    bool no_eol;
+    // the index being read
+    const unsigned char* idx;
+    const unsigned char* ip;
+    size_t idx_size;
+    // or the one being written
+    FILE* out;
+    char* tmp;
+    index_head head;
+};
+
+typedef struct line_scan_t line_scan;
+
+/* up to PACK_LINES lines compressed together, freed with its last line */
+struct pack_t {
+    unsigned refs;
+    size_t raw;
+    size_t size;
+    char data[];
+};
+
+typedef struct pack_t pack;
+
+/* a recently decompressed block */
+struct pack_cache_t {
+    pack* pk;
+    char* raw;
+    size_t cap;
+    unsigned long used;
+};
+
+typedef struct pack_cache_t pack_cache;
+
+/* a page of the scratch file held in memory */
+struct spill_page_t {
+    off_t page;
+    char* data;
+    size_t valid;
+    unsigned long used;
+};
+
+typedef struct spill_page_t spill_page;
+
+/* memory used by line storage, and what one allocation per line would
+ * have used */
+struct stats_t {
+    size_t lines[T_KINDS];
+    size_t shared_entries;
+    size_t packs;
+    size_t packed_raw;
+    size_t pack_hits;
+    size_t pack_misses;
+    size_t spill_hits;
+    size_t spill_misses;
+    size_t chunks;
+    size_t maps;
+    size_t bytes;
+    size_t plain_bytes;
+};
+
+typedef struct stats_t stats;
+
 struct list_t {
     node* first;
     node* last;
     int length;
     bool modified;
+    // the last line had no newline when read
+    bool no_eol;
 };
 
 typedef struct list_t list;
 
+/* A buffer other than the one being edited, which lives in the globals
+ * below: its state is put aside in its slot when another one is switched
+ * to, and put back from there, so a switch copies this and no more. */
+struct buf_state_t {
+    list lines;
+    int current_line;
+    char* filename;
+    bool following;
+    // its journal
+    bool journaling;
+    int journal_fd;
+    char* journal_path;
+    journal_head journal_id;
+    off_t journal_end;
+    bool journal_no_eol;
+    // let go of by em_close, the slot is free for the next buffer
+    bool closed;
+};
+
+typedef struct buf_state_t buf_state;
+
+/* a buffer opened through the library, see em.h */
+struct em_buffer {
+    int slot;
+    FILE* out;
+    const char* error;
+};
+
+/* lines found by the loader thread, sent to the main one through a pipe */
+struct load_batch_t {
+    list lines;
+    // what they add to the stats
+    size_t bytes;
+    size_t plain_bytes;
+    // the file offset after them
+    size_t end;
+    bool done;
+    bool no_eol;
+};
+
+typedef struct load_batch_t load_batch;
+
+/* a run of text in a save snapshot, and whether a newline follows it */
+struct piece_t {
+    const char* text;
+    size_t len : 63;
+    size_t nl : 1;
+};
+
+typedef struct piece_t piece;
+
+/* A w being done by the save thread. The snapshot points at the text of
+ * the lines where it is, which stays put because frees are held back
+ * while a save is pending; only text out of a cache is copied. */
+struct save_t {
+    piece* pieces;
+    size_t count;
+    size_t cap;
+    char** blocks;
+    int nblocks;
+    // the mappings the lines point into
+    map** held;
+    int nheld;
+    char* filename;
+    char* tmp;
+    int fd;
+    // all of the buffer, so it is saved when this is done
+    bool whole;
+    size_t total;
+    int err;
+    // where the journal was when the snapshot was taken
+    unsigned journal_gen;
+    off_t journal_mark;
+};
+
+typedef struct save_t save;
+
+/* block buffered reader used when stdin is not a terminal, and for the
+ * output of shell commands */
+struct reader_t {
+    int fd;
+    char* buf;
+    size_t start;
+    size_t end;
+    size_t cap;
+    bool eof;
+    // the last line returned had no newline
+    bool partial;
+};
+
+typedef struct reader_t reader;
+
+/* sorted listing of a directory, kept for filename completion */
+struct dir_cache_t {
+    char* path;
+    struct timespec mtime;
+    char** names;
+    int count;
+    unsigned long used;
+};
+
+typedef struct dir_cache_t dir_cache;
+
+/* work done while the prompt waits for keys, in short steps; returns
+ * true while there is more to do */
+typedef bool (*idle_task)(void);
+
+enum idle_t {
+    IDLE_TRIM = 1 << 0,
+    IDLE_PACK = 1 << 1,
+    IDLE_SYNC = 1 << 2
+};
+
 enum error_t {
     ADDR,
     CMD,
     IFILE,
     NO_FILE,
-    MOD
+    MOD,
+    SHELL,
+    NO_MATCH,
+    NO_PATTERN,
+    BAD_PATTERN,
+    NO_BUF
+};
+
+enum addr_kind_t {
+    A_NONE,
+    A_LINE,
+    A_CURRENT,
+    A_LAST
+};
+
+/* an address as written, resolved against the buffer when it runs */
+struct addr_t {
+    enum addr_kind_t kind;
+    int offset;
+};
+
+typedef struct addr_t addr;
+
+struct command_t {
+    char name;
+    addr start;
+    addr end;
+    bool chain;
+    enum error_t fault;
+    char* arg;
+    // where m and t put the lines: after dest in buffer dest_buf, or in
+    // this one when that is 0
+    addr dest;
+    int dest_buf;
+    list* text;
+    bool has_text;
+    int lineno;
+    // coalesced run of span commands starting here
+    int span;
+    int run_start;
+    int run_end;
+};
+
+typedef struct command_t command;
+
+static const char* error_messages[] = {
+    "invalid address",
+    "unknown command",
+    "cannot open input file",
+    "no current filename",
+    "warning: file modified",
+    "cannot run command",
+    "no match",
+    "no previous pattern",
+    "invalid pattern",
+    "no such buffer"
 };
 
-list buffer;
-int current_line;
-char* error_msg;
-bool asked;
+static const char* commands = "qQewraicnpdhsSmtbB";
+
+static list buffer;
+static buf_state* buffers;
+static int buffer_count;
+static int current_buffer;
+static reader input;
+static bool interactive;
+static char* history_path;
+static dir_cache dirs[DIR_CACHE_SIZE];
+static unsigned idle_work;
+static bool interning;
+static shared** intern_table;
+static size_t intern_size;
+static stats mem;
+static bool packing;
+static size_t pack_budget;
+static node* pack_cursor;
+static long pack_left;
+static pack_cache unpacked[PACK_CACHE];
+static unsigned long unpack_clock;
+static size_t spill_limit;
+static int spill_fd = -1;
+static off_t spill_end;
+static char* spill_tail;
+static size_t spill_tail_len;
+static size_t spill_tail_cap;
+static node* spill_cursor;
+static spill_page spill_cache[SPILL_CACHE];
+static unsigned long spill_clock;
+static char* spill_line;
+static size_t spill_line_cap;
+static size_t spill_floor;
+static map* maps;
+// files are only mapped with the SIGBUS guard in place, see map_guard
+static bool map_guarded;
+static size_t map_page;
+static bool streaming;
+static reader stream_in;
+static int stream_out = -1;
+static pid_t stream_pid = -1;
+static char* stream_target;
+static char* stream_tmp;
+static size_t stream_total;
+static int line_base;
+static bool following;
+static int follow_fd = -1;
+static int follow_wd = -1;
+static char* follow_path;
+static char* follow_name;
+static dev_t follow_dev;
+static ino_t follow_ino;
+static off_t follow_off;
+static bool async_load;
+static bool loading;
+static pthread_t load_thread;
+static int load_pipe[2] = { -1, -1 };
+static atomic_bool load_stop;
+static line_scan load_scan;
+static map* load_map;
+static size_t load_off;
+static save* save_cur;
+static save* save_next;
+static bool save_threaded;
+static pthread_t save_thread;
+static int save_pipe[2] = { -1, -1 };
+static void** deferred;
+static size_t deferred_count;
+static size_t deferred_cap;
+static bool journaling;
+static int journal_fd = -1;
+static char* journal_path;
+static journal_head journal_id;
+static unsigned journal_gen;
+static off_t journal_end;
+static char* journal_buf;
+static size_t journal_len;
+static size_t journal_cap;
+static size_t journal_rec;
+static bool journal_no_eol;
+static char* flat;
+static size_t flat_cap;
+static regex_t subst_re;
+static bool have_pattern;
+static char* subst_last;
+static char* subst_literal;
+static size_t* subst_edits;
+static size_t subst_edits_cap;
+static char* subst_out;
+static size_t subst_len;
+static size_t subst_cap;
+static unsigned long dir_clock;
+static char* filename;
+static int current_line;
+static const char* error_msg = "";
+static unsigned long error_count;
+static bool asked;
+// where what the commands print goes: stdout, or what em_output says
+static FILE* out;
+static FILE* null_out;
+// set by em_open: q is for the handle's buffer only, not every buffer
+static bool library;
+// the editor is one, the em_ functions take turns on it
+static pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void error(enum error_t type)
+static void error(enum error_t type)
 {
-    if (type == ADDR)
-        error_msg = "invalid address";
-    else if (type == CMD)
-        error_msg = "unknown command";
-    else if (type == IFILE)
-        error_msg = "cannot open input file";
-    else if (type == NO_FILE)
-        error_msg = "no current filename";
-    else if (type == MOD)
-        error_msg = "warning: file modified";
+    error_msg = error_messages[type];
+    error_count++;
+    fprintf(out, "?\n");
+}
 
-    printf("?\n");
+/* bytes malloc really takes for a request of n, glibc style */
+static size_t alloc_size(size_t n)
+{
+    size_t size = (n + sizeof(size_t) + 15) & ~(size_t)15;
+    return size < 32 ? 32 : size;
 }
 
-void print_range(int start, int end, bool show_num)
+/* free p, or keep it until no save needs it */
+static void free_later(void* p)
 {
-    if (buffer.first == NULL || start > end || end > buffer.length) {
-        error(ADDR);
+    if (save_cur == NULL) {
+        free(p);
         return;
     }
 
-    size_t len;
-    int line_num = 1;
-    node* cur = buffer.first;
-
-    while (line_num <= end) {
-        if (line_num >= start) {
-            if (show_num)
-                printf("%d\t%s\n", line_num, cur->line);
-            else
-                printf("%s\n", cur->line);
-        }
-        
-        cur = cur->next;
-        line_num++;
+    if (deferred_count == deferred_cap) {
+        deferred_cap = deferred_cap == 0 ? 1024 : deferred_cap * 2;
+        deferred = realloc(deferred, deferred_cap * sizeof(void*));
     }
-
-    current_line = end;
+    deferred[deferred_count++] = p;
 }
 
-void delete_node(node* nd)
+/* the bytes a node of this kind and length is allocated with */
+static size_t node_size(int kind, size_t len)
 {
-    node* prev = nd->prev;
-    node* next = nd->next;
+    size_t text = kind == T_INLINE ? len + 1 :
+                  kind == T_PACKED ? sizeof(struct pack_ref_t) :
+                  kind == T_SPILLED ? sizeof(off_t) :
+                  kind == T_MAPPED ? sizeof(struct map_ref_t) : sizeof(char*);
 
-    if (prev != NULL)
-        prev->next = next;
+    return offsetof(node, text) + (text > sizeof(char*) ? text : sizeof(char*));
+}
 
-    if (next != NULL)
-        next->prev = prev;
+/* the uncompressed text of pk, from the cache of recent blocks; valid
+ * until PACK_CACHE other blocks have been read */
+static char* unpack(pack* pk)
+{
+    pack_cache* slot = &unpacked[0];
 
-    if (nd == buffer.first) {
-        buffer.first = next;
-    } else if (nd == buffer.last) {
-        buffer.last = prev;
+    for (int i = 0; i < PACK_CACHE; i++) {
+        if (unpacked[i].pk == pk) {
+            unpacked[i].used = ++unpack_clock;
+            mem.pack_hits++;
+            return unpacked[i].raw;
+        }
+        if (unpacked[i].used < slot->used)
+            slot = &unpacked[i];
     }
 
-    buffer.length--;
+    mem.pack_misses++;
 
-    if (current_line > buffer.length)
-        current_line = buffer.length;
+    if (slot->cap < pk->raw) {
+        mem.bytes -= slot->cap > 0 ? alloc_size(slot->cap) : 0;
+        slot->cap = pk->raw;
+        slot->raw = realloc(slot->raw, slot->cap);
+        mem.bytes += alloc_size(slot->cap);
+    }
 
-    free(nd->line);
-    free(nd);
+    lz_decompress(pk->data, pk->size, slot->raw, pk->raw);
+    slot->pk = pk;
+    slot->used = ++unpack_clock;
+    return slot->raw;
 }
 
-void delete_range(int start, int end)
+/* page of the scratch file from the cache, read in on a miss */
+static spill_page* read_page(off_t page)
 {
-    node* cur = buffer.first;
-    int line_num = 1;
+    spill_page* slot = &spill_cache[0];
 
-    if (buffer.first == NULL || start == 0 || end > buffer.length) {
-        error(ADDR);
-        return;
+    for (int i = 0; i < SPILL_CACHE; i++) {
+        if (spill_cache[i].data != NULL && spill_cache[i].page == page) {
+            spill_cache[i].used = ++spill_clock;
+            mem.spill_hits++;
+            return &spill_cache[i];
+        }
+        if (spill_cache[i].used < slot->used)
+            slot = &spill_cache[i];
     }
 
-    while (line_num <= end) {
-        node* next = cur->next;
-        if (line_num >= start)
-            delete_node(cur);
+    mem.spill_misses++;
 
-        cur = next;
-        line_num++;
+    if (slot->data == NULL) {
+        slot->data = malloc(SPILL_PAGE);
+        mem.bytes += alloc_size(SPILL_PAGE);
     }
 
-    buffer.modified = true;
-    asked = false;
+    ssize_t r;
+
+    while ((r = pread(spill_fd, slot->data, SPILL_PAGE, page * SPILL_PAGE)) == -1 && errno == EINTR)
+        ;
+    slot->valid = r > 0 ? r : 0;
+    slot->page = page;
+    slot->used = ++spill_clock;
+    return slot;
 }
 
-void write_buffer(char* filename)
+/* the text of a spilled line; a line across pages is put together in
+ * spill_line, valid until the next such line is read */
+static const char* spilled_text(node* nd)
 {
-    node* cur = buffer.first;
-    int total = 0;
+    off_t off = nd->text.spilled;
+    size_t len = nd->len;
+    size_t in = off % SPILL_PAGE;
 
-    if (filename == NULL) {
-        error(NO_FILE);
-        return;
+    if (in + len <= SPILL_PAGE)
+        return read_page(off / SPILL_PAGE)->data + in;
+
+    if (spill_line_cap < len) {
+        spill_line_cap = len;
+        spill_line = realloc(spill_line, len);
     }
 
-    FILE* fp = fopen(filename, "w");
-    if (fp == NULL) {
-        printf("%s: No such file or directory\n", filename);
-        error(IFILE);
-        return;
+    for (size_t done = 0; done < len; ) {
+        spill_page* pg = read_page((off + done) / SPILL_PAGE);
+        size_t at = (off + done) % SPILL_PAGE;
+        size_t n = SPILL_PAGE - at < len - done ? SPILL_PAGE - at : len - done;
+
+        memcpy(spill_line + done, pg->data + at, n);
+        done += n;
     }
 
-    while (cur != NULL) {
-        int r = fprintf(fp, "%s\n", cur->line);
-        total += r;
-        cur = cur->next;
+    return spill_line;
+}
+
+static void reserve_flat(size_t len)
+{
+    if (flat_cap < len + 1) {
+        flat_cap = len + 1;
+        free(flat);
+        flat = malloc(flat_cap);
     }
+}
 
-    fclose(fp);
-    printf("%d\n", total);
-    buffer.modified = false;
+/* the text of a long line in one piece, in flat */
+static const char* rope_text(rope* rp, size_t len)
+{
+    reserve_flat(len);
+
+    for (int i = 0; i < rp->count; i++)
+        memcpy(flat + rp->ends[i] - rp->chunks[i]->len, rp->chunks[i]->data, rp->chunks[i]->len);
+    flat[len] = 0;
+
+    return flat;
 }
 
-/* read file into a doubly linked list of lines */
-void read_file(char* filename)
+static const char* line_text(node* nd)
 {
-    node* root = NULL;
-    node* prev;
-    int total = 0;
+    nd->touched = 1;
 
-    FILE* fp = fopen(filename, "r");
-    if (fp == NULL) {
-        printf("%s: No such file or directory\n", filename);
-        error(IFILE);
-        return;
+    switch (nd->kind) {
+        case T_CHUNKED:
+            return rope_text(nd->text.rope, nd->len);
+        case T_INLINE:
+            return nd->text.buf;
+        case T_PACKED:
+            return unpack(nd->text.packed.pack) + nd->text.packed.offset;
+        case T_SPILLED:
+            return spilled_text(nd);
+        case T_MAPPED:
+            return nd->text.mapped.map->base + nd->text.mapped.offset;
+        default:
+            return nd->text.ptr;
     }
+}
 
-    rewind(fp);
-
-    for (;;) {
-        char* line = NULL;
-        size_t len = 0;
-        int r = getline(&line, &len, fp);
+/* the text of a line with a NUL after it, copied to flat when it is not
+ * stored that way; valid until the next call */
+static const char* flat_text(node* nd)
+{
+    if (nd->kind == T_INLINE || nd->kind == T_SHARED || nd->kind == T_CHUNKED)
+        return line_text(nd);
 
-        if (r == -1)
-            break;
+    const char* text = line_text(nd);
 
-        total += r;
+    reserve_flat(nd->len);
+    memcpy(flat, text, nd->len);
+    flat[nd->len] = 0;
+    return flat;
+}
 
-        node* cur = malloc(sizeof(node));
-        line[strlen(line)-1] = 0;
-        cur->line = line;
+static void release_pack(pack* pk)
+{
+    if (--pk->refs > 0)
+        return;
 
-        if (root == NULL) {
-            root = cur;
-            root->prev = NULL;
-        } else {
-            prev->next = cur;
-            cur->prev = prev;
-        }
+    for (int i = 0; i < PACK_CACHE; i++)
+        if (unpacked[i].pk == pk)
+            unpacked[i].pk = NULL;
 
-        prev = cur;
-        buffer.last = cur;
-        buffer.length++;
-    }
+    mem.packs--;
+    mem.packed_raw -= pk->raw;
+    mem.bytes -= alloc_size(sizeof(pack) + pk->size);
+    free(pk);
+}
 
-    buffer.first = root;
-    buffer.last->next = NULL;
-    current_line = buffer.length;
-    buffer.modified = false;
+/* what a line costs as a plain node with a separately allocated string */
+static size_t plain_size(size_t len)
+{
+    return alloc_size(3 * sizeof(void*)) + alloc_size(len + 1);
+}
 
-    printf("%d\n", total);
+static unsigned hash_text(const char* text, size_t len)
+{
+    unsigned h = 2166136261u;
 
-    fclose(fp);
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)text[i]) * 16777619u;
+    return h;
 }
 
-bool is_str_digit(char* str)
+static void intern_grow()
 {
-    for (int i = 0; i < strlen(str); i++) {
-        if (!isdigit(str[i]))
-            return false;
+    size_t size = intern_size == 0 ? 1024 : intern_size * 2;
+    shared** table = calloc(size, sizeof(shared*));
+
+    for (size_t i = 0; i < intern_size; i++) {
+        shared* sh = intern_table[i];
+
+        while (sh != NULL) {
+            shared* next = sh->next;
+            sh->next = table[sh->hash & (size - 1)];
+            table[sh->hash & (size - 1)] = sh;
+            sh = next;
+        }
     }
 
-    return true;
+    free(intern_table);
+    intern_table = table;
+    intern_size = size;
 }
 
-int parse_macro(char c)
+/* the shared copy of text, made on first use */
+static char* intern(const char* text, size_t len)
 {
-    switch (c) {
-        case '.':
-            return current_line;
-        case '$':
-            return buffer.length;
-        case '+':
-            return current_line + 1;
-        case '-':
-            return current_line - 1;
-        case ',':
-            return 1;
-        default:
-            return -1;
+    unsigned h = hash_text(text, len);
+
+    if (mem.shared_entries >= intern_size)
+        intern_grow();
+
+    shared** head = &intern_table[h & (intern_size - 1)];
+
+    for (shared* sh = *head; sh != NULL; sh = sh->next) {
+        if (sh->hash == h && sh->len == len && memcmp(sh->text, text, len) == 0) {
+            sh->refs++;
+            return sh->text;
+        }
     }
+
+    shared* sh = malloc(sizeof(shared) + len + 1);
+    sh->len = len;
+    sh->hash = h;
+    sh->refs = 1;
+    memcpy(sh->text, text, len);
+    sh->text[len] = 0;
+    sh->next = *head;
+    *head = sh;
+
+    mem.shared_entries++;
+    mem.bytes += alloc_size(sizeof(shared) + len + 1);
+    return sh->text;
 }
 
-void parse_line_num(char* line, int* start)
+static void release(char* text)
 {
-    if (is_str_digit(line))
-        sscanf(line, "%d", start);
-    else
-        *start = parse_macro(line[0]);
+    shared* sh = (shared*)(text - offsetof(shared, text));
+
+    if (--sh->refs > 0)
+        return;
+
+    shared** link = &intern_table[sh->hash & (intern_size - 1)];
+
+    while (*link != sh)
+        link = &(*link)->next;
+    *link = sh->next;
+
+    mem.shared_entries--;
+    mem.bytes -= alloc_size(sizeof(shared) + sh->len + 1);
+    free_later(sh);
 }
 
-// This is super messy. I may clean it up later
-char parse(const char* line, int* start, int* end)
+static chunk* new_chunk(const char* text, size_t len)
 {
-    char command = 0;
-    int matches;
+    chunk* ch = malloc(sizeof(chunk) + len);
 
-    if (isdigit(line[0])) {
-        matches = sscanf(line, "%d %c", start, &command);
+    ch->len = len;
+    memcpy(ch->data, text, len);
+    mem.chunks++;
+    mem.bytes += alloc_size(sizeof(chunk) + len);
+    return ch;
+}
 
-        if (matches == 1 && *start != -1) {
-            command = 'p';
-        } else if (matches == 2) {
-            if (command == ',') {
-                char start_str[11];
-                char end_str[11];
-                matches = sscanf(line, "%10[0-9.$-+] , %10[0-9.$-+] %c[a-z]", start_str, end_str, &command);
+static void free_chunk(chunk* ch)
+{
+    mem.chunks--;
+    mem.bytes -= alloc_size(sizeof(chunk) + ch->len);
+    free_later(ch);
+}
 
-                if (matches != 3) {
-                    return 0;
-                }
+/* the chunk holding offset off, or count when off is the end */
+static int rope_find(rope* rp, size_t off)
+{
+    int lo = 0;
+    int hi = rp->count;
 
-                parse_line_num(start_str, start);
-                parse_line_num(end_str, end);
-            }
-        }
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
 
-    } else if (parse_macro(line[0]) != -1) {
-        if (strlen(line) == 1)
-            command = 'p';
+        if (rp->ends[mid] <= off)
+            lo = mid + 1;
         else
-            command = line[1];
-        *start = parse_macro(line[0]);
-
-        if (line[0] == ',')
-            *end = buffer.length;
-    } else {
-        command = line[0];
+            hi = mid;
     }
 
-    return command;
+    return lo;
 }
 
-int insert_into_buffer(list* lst, int num)
+/* Replace chunks [from, to) with len bytes of text, cut in even pieces
+ * of at most CHUNK_SIZE. */
+static void rope_replace(rope* rp, int from, int to, const char* text, size_t len)
 {
-    if (lst == NULL)
-        return 0;
+    int n = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    int count = rp->count - (to - from) + n;
 
-    node* before = buffer.first;
-    int line_num = 1;
+    for (int i = from; i < to; i++)
+        free_chunk(rp->chunks[i]);
 
-    while (line_num++ < num)
-        before = before->next;
+    if (count > rp->cap) {
+        int cap = rp->cap == 0 ? 16 : rp->cap;
 
-    node* after = before->next;
+        while (cap < count)
+            cap *= 2;
 
-    if (num != 0) {
-        if (before != NULL)
-            before->next = lst->first;
-        lst->first->prev = before;
+        if (rp->cap > 0)
+            mem.bytes -= alloc_size(rp->cap * sizeof(chunk*)) + alloc_size(rp->cap * sizeof(size_t));
+        mem.bytes += alloc_size(cap * sizeof(chunk*)) + alloc_size(cap * sizeof(size_t));
 
-        if (after != NULL)
-            after->prev = lst->last;
-        else
-            buffer.last = lst->last;
-        lst->last->next = after;
-    } else {
-        buffer.first = lst->first;
-        lst->last->next = before;
+        rp->chunks = realloc(rp->chunks, cap * sizeof(chunk*));
+        rp->ends = realloc(rp->ends, cap * sizeof(size_t));
+        rp->cap = cap;
     }
 
-    buffer.length += lst->length;
-    buffer.modified = true;
-    int wrote = lst->length;
+    memmove(rp->chunks + from + n, rp->chunks + to, (rp->count - to) * sizeof(chunk*));
+    rp->count = count;
 
-    free(lst);
+    for (int i = 0; i < n; i++) {
+        size_t piece = len / n + ((size_t)i < len % n);
 
-    return wrote;
-}
+        rp->chunks[from + i] = new_chunk(text, piece);
+        text += piece;
+    }
 
-void init_list(list* lst)
-{
-    lst->first = NULL;
-    lst->last = NULL;
-    lst->length = 0;
-    lst->modified = false;
+    for (int i = from; i < count; i++)
+        rp->ends[i] = (i > 0 ? rp->ends[i - 1] : 0) + rp->chunks[i]->len;
 }
 
-list* text_input()
+/* Replace del bytes at off with n bytes of text. Only the chunks the
+ * edit touches are rebuilt, with a small neighbour taken in so that
+ * repeated edits do not leave a trail of tiny chunks. */
+static void rope_splice(rope* rp, size_t off, size_t del, const char* text, size_t n)
 {
-    list* input_buffer = malloc(sizeof(list));
-    init_list(input_buffer);
+    int from = rope_find(rp, off);
+    int to = rope_find(rp, off + del);
 
-    node* root = NULL;
-    node* prev;
-    char* line;
+    if (to < rp->count)
+        to++;
+    if (from > 0 && (from == rp->count || rp->chunks[from]->len < CHUNK_SIZE / 4))
+        from--;
+    if (to < rp->count && rp->chunks[to]->len < CHUNK_SIZE / 4)
+        to++;
 
-    while ((line = linenoise("")) != NULL) {
-        if (strcmp(".", line) == 0) {
-            free(line);
-            break;
-        }
+    size_t start = from > 0 ? rp->ends[from - 1] : 0;
+    size_t end = to > 0 ? rp->ends[to - 1] : 0;
+    size_t len = end - start - del + n;
+    char* buf = malloc(len);
+    size_t at = 0;
+    bool put = false;
 
-        node* cur = malloc(sizeof(node));
-        cur->line = line;
+    for (int i = from; i < to; i++) {
+        chunk* ch = rp->chunks[i];
+        size_t base = rp->ends[i] - ch->len;
 
-        if (root == NULL) {
-            root = cur;
-            root->prev = NULL;
-        } else {
-            prev->next = cur;
-            cur->prev = prev;
+        // the part of the chunk before the edit, then the part after it
+        if (base < off) {
+            size_t k = off - base < ch->len ? off - base : ch->len;
+            memcpy(buf + at, ch->data, k);
+            at += k;
+        }
+        if (!put && base <= off && off <= rp->ends[i]) {
+            memcpy(buf + at, text, n);
+            at += n;
+            put = true;
+        }
+        if (rp->ends[i] > off + del) {
+            size_t k = base > off + del ? 0 : off + del - base;
+            memcpy(buf + at, ch->data + k, ch->len - k);
+            at += ch->len - k;
         }
-
-        prev = cur;
-        input_buffer->last = cur;
-        input_buffer->length++;
     }
 
-    if (root == NULL) {
-        free(input_buffer);
-        return NULL;
+    if (!put) {
+        memcpy(buf + at, text, n);
+        at += n;
     }
 
-    input_buffer->first = root;
-    input_buffer->last->next = NULL;
+    rope_replace(rp, from, to, buf, at);
+    free(buf);
+}
 
-    return input_buffer;
+static rope* new_rope(const char* text, size_t len)
+{
+    rope* rp = calloc(1, sizeof(rope));
+
+    mem.bytes += alloc_size(sizeof(rope));
+    rope_replace(rp, 0, 0, text, len);
+    return rp;
 }
 
-int main(int argc, char* argv[])
+static void free_rope(rope* rp)
 {
-    char* filename = NULL;
-    char* line;
-    list* input;
-    error_msg = "";
-    asked = false;
-    int w;
+    for (int i = 0; i < rp->count; i++)
+        free_chunk(rp->chunks[i]);
 
-    init_list(&buffer);
+    mem.bytes -= alloc_size(sizeof(rope));
+    if (rp->cap > 0)
+        mem.bytes -= alloc_size(rp->cap * sizeof(chunk*)) + alloc_size(rp->cap * sizeof(size_t));
 
-    if (argc > 1) {
-        filename = argv[1];
-        read_file(filename);
+    free(rp->chunks);
+    free(rp->ends);
+    free(rp);
+}
+
+/* Make a node of the given kind holding a copy of len bytes of text. The
+ * allocation is cut to the kind, often short of sizeof(node), so it is
+ * filled in through char pointers: the compiler would see a store
+ * through a node* as running past it. */
+static node* make_node(int kind, const char* text, size_t len)
+{
+    size_t size = node_size(kind, len);
+    node head = { .len = len, .touched = 1, .kind = kind };
+    char* p = malloc(size);
+    char* payload = p + offsetof(node, text);
+
+    memcpy(p, &head, offsetof(node, text));
+    if (kind == T_CHUNKED) {
+        rope* rp = new_rope(text, len);
+
+        memcpy(payload, &rp, sizeof(rp));
+    } else if (kind == T_SHARED) {
+        char* shared = intern(text, len);
+
+        memcpy(payload, &shared, sizeof(shared));
+    } else {
+        memcpy(payload, text, len);
+        payload[len] = 0;
     }
 
-    while ((line = linenoise("")) != NULL) {
-        int start = -1;
-        int end = -1;
+    mem.lines[kind]++;
+    mem.bytes += alloc_size(size);
+    mem.plain_bytes += plain_size(len);
+    return (node*)p;
+}
 
-        char command = parse(line, &start, &end);
+/* make a node holding a copy of len bytes of text */
+static node* new_node(const char* text, size_t len)
+{
+    return make_node(len >= CHUNK_MIN ? T_CHUNKED :
+                     interning && len >= INLINE_SIZE ? T_SHARED : T_INLINE, text, len);
+}
 
-        if (command == 0) {
-            if (start > buffer.length ||
-                    start == 0 ||
-                    (end != -1 && start > end)) {
-                error(ADDR);
-            } else {
-                error(CMD);
-            }
+/* allocate the node for a line of a mapped file, without counting it
+ * anywhere: the loader thread makes them too */
+static node* alloc_mapped(map* mp, size_t offset, size_t len)
+{
+    node* nd = malloc(node_size(T_MAPPED, len));
 
-            free(line);
-            continue;
-        }
+    nd->kind = T_MAPPED;
+    nd->text.mapped.map = mp;
+    nd->text.mapped.offset = offset;
+    nd->len = len;
+    nd->touched = 1;
+    return nd;
+}
 
-        if (start == -1 && end == -1)
-            start = current_line;
+/* make a node for the line at offset in a mapped file */
+static node* new_mapped(map* mp, size_t offset, size_t len)
+{
+    size_t size = node_size(T_MAPPED, len);
+    node* nd = alloc_mapped(mp, offset, len);
 
-        if (start != -1 && end == -1)
-            end = start;
+    mp->refs++;
 
-        switch (command) {
-            case 'q':
-                if (buffer.modified && !asked) {
-                    error(MOD);
-                    asked = true;
-                } else {
-                    return 0;
-                }
-                break;
-            case 'Q':
-                return 0;
-            case 'e':
-                if (strlen(line) > 2)
-                    filename = line + 2;
-                else
-                    error(NO_FILE);
+    mem.lines[T_MAPPED]++;
+    mem.bytes += alloc_size(size);
+    mem.plain_bytes += plain_size(len);
+    return nd;
+}
 
-                read_file(filename);
-                break;
-            case 'w':
-                if (strlen(line) > 2)
-                    filename = line + 2;
-                write_buffer(filename);
-                break;
-            case 'a':
-                input = text_input();
-                w = insert_into_buffer(input, end);
-                current_line += w;
-                break;
-            case 'i':
-                input = text_input();
-                w = insert_into_buffer(input, start-1);
-                current_line = start-1 + w;
-                break;
-            case 'c':
-                delete_range(start, end);
-                input = text_input();
-                w = insert_into_buffer(input, start-1);
-                current_line = start-1 + w;
-                break;
-            case 'n':
-                print_range(start, end, true);
-                break;
-            case 'p':
-                print_range(start, end, false);
+static void release_map(map* mp)
+{
+    if (--mp->refs > 0)
+        return;
+
+    map** link = &maps;
+
+    while (*link != mp)
+        link = &(*link)->next;
+    *link = mp->next;
+
+    munmap(mp->base, mp->size);
+    if (mp->fd != -1)
+        close(mp->fd);
+    mem.maps--;
+    mem.bytes -= alloc_size(sizeof(map));
+    free(mp->path);
+    free(mp);
+}
+
+/* SIGBUS from a mapped file cut short under us: the pages from the
+ * fault on are replaced with zeros so the read goes on, and map_check
+ * reports the file before the next command. Any other fault is not
+ * ours and kills as it would have. */
+static void map_fault(int sig, siginfo_t* si, void* ctx)
+{
+    char* at = si->si_addr;
+
+    for (map* mp = maps; mp != NULL; mp = mp->next) {
+        if (at < mp->base || at >= mp->base + mp->size)
+            continue;
+
+        char* from = mp->base + ((at - mp->base) & ~(map_page - 1));
+
+        if (mmap(from, mp->base + mp->size - from, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+            return;
+    }
+
+    signal(SIGBUS, SIG_DFL);
+}
+
+/* let files be mapped; em does, a library host keeps its signals */
+static void map_guard()
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = map_fault;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    map_page = sysconf(_SC_PAGESIZE);
+    map_guarded = sigaction(SIGBUS, &sa, NULL) == 0;
+}
+
+/* Stop mp following its file: each page still in the file is written to
+ * as it is, which makes it a private copy, the rest becomes zeros. Lines
+ * keep their place, and a loader reading them sees no gap. */
+static void map_detach(map* mp, size_t valid)
+{
+    volatile char* p = mp->base;
+
+    for (size_t off = 0; off < mp->size; off += map_page) {
+        if (off >= valid) {
+            mmap(mp->base + off, mp->size - off, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            break;
+        }
+        p[off] = p[off];
+    }
+
+    close(mp->fd);
+    mp->fd = -1;
+}
+
+/* Before lines are trusted to the mappings: a file written to or cut
+ * short since it was mapped is detached from, and said so, since its
+ * lines may show the change. A file replaced by rename is not touched,
+ * the mapping keeps the old one. */
+static void map_check()
+{
+    for (map* mp = maps; mp != NULL; mp = mp->next) {
+        struct stat st;
+
+        if (mp->fd == -1 || fstat(mp->fd, &st) == -1)
+            continue;
+        if ((size_t)st.st_size == mp->size && st.st_mtim.tv_sec == mp->mtime.tv_sec &&
+            st.st_mtim.tv_nsec == mp->mtime.tv_nsec)
+            continue;
+
+        map_detach(mp, (size_t)st.st_size < mp->size ? (size_t)st.st_size : mp->size);
+        fprintf(out, "%s: changed on disk, lines read from it may have changed\n", mp->path);
+    }
+}
+
+/* is the file at path mapped, so that lines still point into it */
+static bool is_mapped(const char* path, struct stat* st)
+{
+    if (maps == NULL || stat(path, st) == -1)
+        return false;
+
+    for (map* mp = maps; mp != NULL; mp = mp->next)
+        if (mp->fd != -1 && mp->dev == st->st_dev && mp->ino == st->st_ino)
+            return true;
+
+    return false;
+}
+
+static void free_node(node* nd)
+{
+    if (nd->kind == T_SHARED)
+        release(nd->text.ptr);
+    else if (nd->kind == T_PACKED)
+        release_pack(nd->text.packed.pack);
+    else if (nd->kind == T_CHUNKED)
+        free_rope(nd->text.rope);
+    else if (nd->kind == T_MAPPED)
+        release_map(nd->text.mapped.map);
+
+    if (nd == pack_cursor)
+        pack_cursor = nd->next;
+    if (nd == spill_cursor)
+        spill_cursor = nd->next;
+
+    mem.lines[nd->kind]--;
+    mem.bytes -= alloc_size(node_size(nd->kind, nd->len));
+    mem.plain_bytes -= plain_size(nd->len);
+    free_later(nd);
+}
+
+/* the S command: line storage and how it compares to a plain node and
+ * string per line; negative savings mean interning did not pay off */
+static void print_stats()
+{
+    long long saved = (long long)mem.plain_bytes - (long long)mem.bytes;
+
+    fprintf(out, "lines\t%d\n", buffer.length);
+    fprintf(out, "inline\t%zu\n", mem.lines[T_INLINE]);
+    fprintf(out, "shared\t%zu in %zu copies\n", mem.lines[T_SHARED], mem.shared_entries);
+    fprintf(out, "memory\t%zu bytes, %zu as plain lines\n", mem.bytes, mem.plain_bytes);
+    fprintf(out, "saved\t%lld bytes (%.1f%%)\n", saved,
+           mem.plain_bytes ? 100.0 * saved / mem.plain_bytes : 0.0);
+
+    if (packing) {
+        fprintf(out, "packed\t%zu in %zu blocks, %zu bytes of text\n",
+               mem.lines[T_PACKED], mem.packs, mem.packed_raw);
+        fprintf(out, "unpack\t%zu hits, %zu misses\n", mem.pack_hits, mem.pack_misses);
+    }
+
+    if (mem.lines[T_MAPPED] > 0)
+        fprintf(out, "mapped\t%zu in %zu files\n", mem.lines[T_MAPPED], mem.maps);
+
+    if (mem.lines[T_CHUNKED] > 0)
+        fprintf(out, "chunked\t%zu in %zu chunks\n", mem.lines[T_CHUNKED], mem.chunks);
+
+    if (spill_limit) {
+        fprintf(out, "spilled\t%zu, %lld bytes in the scratch file\n",
+               mem.lines[T_SPILLED], (long long)spill_end);
+        fprintf(out, "pages\t%zu hits, %zu misses\n", mem.spill_hits, mem.spill_misses);
+    }
+
+    if (following)
+        fprintf(out, "follow\t%s at %lld bytes\n", follow_path, (long long)follow_off);
+
+    if (loading)
+        fprintf(out, "loading\t%zu of %zu bytes\n", load_off, load_map->size);
+
+    if (journal_fd != -1)
+        fprintf(out, "journal\t%s, %lld bytes\n", journal_path, (long long)journal_end);
+
+    if (save_cur != NULL)
+        fprintf(out, "saving\t%s%s, %zu frees held\n", save_cur->filename,
+               save_next != NULL ? " and one queued" : "", deferred_count);
+}
+
+/* find the node for line num, walking from whichever end is closer */
+static node* node_at(int num)
+{
+    node* cur;
+
+    if (num < 1 || num > buffer.length)
+        return NULL;
+
+    if (num <= buffer.length / 2) {
+        cur = buffer.first;
+        while (--num > 0)
+            cur = cur->next;
+    } else {
+        cur = buffer.last;
+        while (num++ < buffer.length)
+            cur = cur->prev;
+    }
+
+    return cur;
+}
+
+static void print_range(int start, int end, bool show_num)
+{
+    if (buffer.first == NULL || start < 1 || start > end || end > buffer.length) {
+        error(ADDR);
+        return;
+    }
+
+    node* cur = node_at(start);
+
+    for (int line_num = start; line_num <= end; line_num++) {
+        if (show_num)
+            fprintf(out, "%d\t", line_base + line_num);
+
+        if (cur->kind == T_CHUNKED) {
+            rope* rp = cur->text.rope;
+
+            for (int i = 0; i < rp->count; i++)
+                fwrite(rp->chunks[i]->data, 1, rp->chunks[i]->len, out);
+        } else {
+            fwrite(line_text(cur), 1, cur->len, out);
+        }
+        fputc('\n', out);
+
+        cur = cur->next;
+    }
+
+    current_line = end;
+}
+
+static void journal_put(const void* data, size_t n)
+{
+    if (journal_len + n > journal_cap) {
+        journal_cap = journal_len + n > 2 * journal_cap ? journal_len + n : 2 * journal_cap;
+        journal_buf = realloc(journal_buf, journal_cap);
+    }
+
+    memcpy(journal_buf + journal_len, data, n);
+    journal_len += n;
+}
+
+static void journal_varint(uint64_t v)
+{
+    unsigned char b[10];
+    int n = 0;
+
+    for (; v >= 0x80; v >>= 7)
+        b[n++] = 0x80 | (v & 0x7f);
+    b[n++] = v;
+    journal_put(b, n);
+}
+
+/* start a record; its length and checksum go in when it is done */
+static void record_start(char op)
+{
+    char head[JOURNAL_RECORD] = { 0 };
+
+    journal_rec = journal_len;
+    journal_put(head, sizeof(head));
+    journal_put(&op, 1);
+}
+
+static void record_done()
+{
+    char* rec = journal_buf + journal_rec;
+    uint64_t len = journal_len - journal_rec - JOURNAL_RECORD;
+    uint32_t crc = crc32c(0, rec + JOURNAL_RECORD, len);
+
+    memcpy(rec, &len, 8);
+    memcpy(rec + 8, &crc, 4);
+}
+
+/* write len bytes of data to fd, retrying short and interrupted
+ * writes; returns how many went out, less than len on an error */
+static size_t write_all(int fd, const void* data, size_t len)
+{
+    const char* p = data;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t r = write(fd, p + done, len - done);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+            break;
+        done += r;
+    }
+
+    return done;
+}
+
+/* Write out the records held so far. The journal is only made when
+ * there is something to put in it, and synced when the prompt is idle. */
+static void journal_write()
+{
+    if (journal_len == 0)
+        return;
+
+    if (journal_fd == -1) {
+        journal_fd = open(journal_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (journal_fd != -1 && write_all(journal_fd, &journal_id, sizeof(journal_id)) == sizeof(journal_id))
+            journal_end = sizeof(journal_id);
+    }
+
+    size_t left = journal_fd != -1 ? journal_len - write_all(journal_fd, journal_buf, journal_len) : journal_len;
+
+    if (journal_fd == -1 || left > 0) {
+        fprintf(out, "%s: %s, edits are not journaled\n", journal_path, strerror(errno));
+        journaling = false;
+    }
+
+    journal_end += journal_len - left;
+    journal_len = 0;
+    idle_work |= IDLE_SYNC;
+
+    // one long line can leave it large, don't keep that
+    if (journal_cap > 2 * JOURNAL_SPLIT) {
+        free(journal_buf);
+        journal_buf = NULL;
+        journal_cap = 0;
+    }
+}
+
+/* lines start to end are about to be deleted */
+static void journal_delete(int start, int end)
+{
+    if (!journaling)
+        return;
+
+    record_start('d');
+    journal_varint(start);
+    journal_varint(end);
+    record_done();
+}
+
+/* The lines of lst are about to go in after line num; a record holds
+ * about JOURNAL_SPLIT bytes of them, and each is written out when done,
+ * so that reading a large file in takes no more than that in memory. */
+static void journal_insert(int num, list* lst)
+{
+    if (!journaling)
+        return;
+
+    size_t start = 0;
+    bool open = false;
+
+    for (node* cur = lst->first; cur != NULL; cur = cur->next) {
+        if (!open) {
+            record_start('i');
+            journal_varint(num);
+            start = journal_len;
+            open = true;
+        }
+
+        journal_varint(cur->len);
+        journal_put(line_text(cur), cur->len);
+        num++;
+
+        if (journal_len - start >= JOURNAL_SPLIT) {
+            record_done();
+            open = false;
+            journal_write();
+            if (!journaling)
+                return;
+        }
+    }
+
+    if (open)
+        record_done();
+}
+
+/* line num was changed by the found edits of the last substitution:
+ * only what they put in is kept, not the line */
+static void journal_subst(int num, size_t found)
+{
+    if (!journaling)
+        return;
+
+    record_start('s');
+    journal_varint(num);
+
+    for (size_t i = 0; i < found; i++) {
+        size_t at = subst_edits[3 * i + 2];
+        size_t end = i + 1 < found ? subst_edits[3 * i + 5] : subst_len;
+
+        journal_varint(subst_edits[3 * i]);
+        journal_varint(subst_edits[3 * i + 1]);
+        journal_varint(end - at);
+        journal_put(subst_out + at, end - at);
+    }
+
+    record_done();
+}
+
+/* the buffer is about to be emptied */
+static void journal_clear()
+{
+    if (!journaling)
+        return;
+
+    record_start('z');
+    record_done();
+}
+
+/* Write out the records of the last command, in one go, so a command
+ * costs a write of what it changed; inserts of more than JOURNAL_SPLIT
+ * have gone out already. */
+static void journal_flush()
+{
+    if (!journaling)
+        return;
+
+    if (buffer.no_eol != journal_no_eol) {
+        char flag = buffer.no_eol;
+
+        record_start('n');
+        journal_put(&flag, 1);
+        record_done();
+        journal_no_eol = buffer.no_eol;
+    }
+
+    journal_write();
+}
+
+static void delete_node(node* nd)
+{
+    node* prev = nd->prev;
+    node* next = nd->next;
+
+    if (prev != NULL)
+        prev->next = next;
+
+    if (next != NULL)
+        next->prev = prev;
+
+    if (nd == buffer.first)
+        buffer.first = next;
+
+    if (nd == buffer.last) {
+        buffer.last = prev;
+        buffer.no_eol = false;
+    }
+
+    buffer.length--;
+
+    if (current_line > buffer.length)
+        current_line = buffer.length;
+
+    free_node(nd);
+}
+
+static void delete_range(int start, int end)
+{
+    if (buffer.first == NULL || start < 1 || end > buffer.length) {
+        error(ADDR);
+        return;
+    }
+
+    journal_delete(start, end);
+
+    node* cur = node_at(start);
+
+    for (int line_num = start; line_num <= end; line_num++) {
+        node* next = cur->next;
+        delete_node(cur);
+        cur = next;
+    }
+
+    buffer.modified = true;
+    asked = false;
+}
+
+static void init_list(list* lst)
+{
+    lst->first = NULL;
+    lst->last = NULL;
+    lst->length = 0;
+    lst->modified = false;
+    lst->no_eol = false;
+}
+
+static void append_node(list* lst, node* cur)
+{
+    cur->next = NULL;
+    cur->prev = lst->last;
+
+    if (lst->last != NULL)
+        lst->last->next = cur;
+    else
+        lst->first = cur;
+
+    lst->last = cur;
+    lst->length++;
+}
+
+static void clear_buffer()
+{
+    node* cur = buffer.first;
+
+    while (cur != NULL) {
+        node* next = cur->next;
+        free_node(cur);
+        cur = next;
+    }
+
+    init_list(&buffer);
+    current_line = 0;
+}
+
+/* change a node's allocation to size; it may move, so link it in again.
+ * The links are read before, size may be short of sizeof(node). */
+static node* resize_node(node* nd, size_t size)
+{
+    bool packing_here = pack_cursor == nd;
+    bool spilling_here = spill_cursor == nd;
+    node* prev = nd->prev;
+    node* next = nd->next;
+    node* moved = realloc(nd, size);
+
+    if (prev != NULL)
+        prev->next = moved;
+    else
+        buffer.first = moved;
+
+    if (next != NULL)
+        next->prev = moved;
+    else
+        buffer.last = moved;
+
+    if (packing_here)
+        pack_cursor = moved;
+    if (spilling_here)
+        spill_cursor = moved;
+
+    return moved;
+}
+
+/* the scratch file is unlinked right away, nothing is left behind */
+static bool open_scratch()
+{
+    const char* dir = getenv("TMPDIR");
+
+    if (dir == NULL)
+        dir = "/tmp";
+
+    char* path = malloc(strlen(dir) + sizeof("/em.XXXXXX"));
+    sprintf(path, "%s/em.XXXXXX", dir);
+    spill_fd = mkstemp(path);
+    if (spill_fd != -1) {
+        unlink(path);
+        // not for shell commands to inherit
+        fcntl(spill_fd, F_SETFD, FD_CLOEXEC);
+    }
+    free(path);
+
+    return spill_fd != -1;
+}
+
+/* append the pending texts to the scratch file and point their nodes at
+ * it; nothing changes if the write fails */
+static bool commit_spill(node** batch, off_t* offsets, int n)
+{
+    size_t done = 0;
+
+    while (done < spill_tail_len) {
+        ssize_t r = pwrite(spill_fd, spill_tail + done, spill_tail_len - done, spill_end + done);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            fprintf(stderr, "scratch file: %s, no longer spilling\n", strerror(errno));
+            spill_limit = 0;
+            spill_tail_len = 0;
+            return false;
+        }
+        done += r;
+    }
+
+    // cached copies of the last page are out of date now
+    for (int i = 0; i < SPILL_CACHE; i++)
+        if (spill_cache[i].page >= spill_end / SPILL_PAGE)
+            spill_cache[i].page = -1;
+
+    for (int i = 0; i < n; i++) {
+        node* nd = batch[i];
+
+        mem.bytes -= alloc_size(node_size(T_INLINE, nd->len));
+        mem.bytes += alloc_size(node_size(T_SPILLED, 0));
+        mem.lines[T_INLINE]--;
+        mem.lines[T_SPILLED]++;
+
+        nd->kind = T_SPILLED;
+        nd->text.spilled = spill_end + offsets[i];
+        resize_node(nd, node_size(T_SPILLED, 0));
+    }
+
+    spill_end += spill_tail_len;
+    spill_tail_len = 0;
+    return true;
+}
+
+/* does moving the text to the scratch file make the node smaller */
+static bool spillable(node* nd)
+{
+    return nd->kind == T_INLINE &&
+           alloc_size(node_size(T_SPILLED, 0)) < alloc_size(node_size(T_INLINE, nd->len));
+}
+
+/* Move the text of lines not read lately to the scratch file until line
+ * storage is down to target. spill_cursor is the hand of a clock sweep:
+ * a line read since the hand last passed is spared once. */
+static void spill_cold(size_t target)
+{
+    node* batch[SPILL_BATCH];
+    off_t offsets[SPILL_BATCH];
+    size_t pending = 0;
+    long visits = 2 * (long)buffer.length;
+    int n = 0;
+
+    if (spill_fd == -1 && !open_scratch()) {
+        fprintf(stderr, "scratch file: %s, no longer spilling\n", strerror(errno));
+        spill_limit = 0;
+        return;
+    }
+
+    while (mem.bytes - pending > target && visits-- > 0) {
+        if (spill_cursor == NULL) {
+            // a batch never holds the same line twice
+            if (n > 0 && !commit_spill(batch, offsets, n))
+                return;
+            n = 0;
+            pending = 0;
+            spill_cursor = buffer.first;
+        }
+
+        node* nd = spill_cursor;
+        spill_cursor = nd->next;
+
+        if (!spillable(nd))
+            continue;
+
+        if (nd->touched) {
+            nd->touched = 0;
+            continue;
+        }
+
+        if (spill_tail_len + nd->len > spill_tail_cap) {
+            spill_tail_cap = spill_tail_len + nd->len > SPILL_PAGE ?
+                             spill_tail_len + nd->len : SPILL_PAGE;
+            spill_tail = realloc(spill_tail, spill_tail_cap);
+        }
+
+        memcpy(spill_tail + spill_tail_len, nd->text.buf, nd->len);
+        offsets[n] = spill_tail_len;
+        batch[n++] = nd;
+        spill_tail_len += nd->len;
+        pending += alloc_size(node_size(T_INLINE, nd->len)) -
+                   alloc_size(node_size(T_SPILLED, 0));
+
+        if (n == SPILL_BATCH || spill_tail_len >= SPILL_PAGE) {
+            if (!commit_spill(batch, offsets, n))
+                return;
+            n = 0;
+            pending = 0;
+        }
+    }
+
+    if (n > 0)
+        commit_spill(batch, offsets, n);
+
+    // nothing more to spill: wait until storage grows before sweeping again
+    spill_floor = mem.bytes > target ? mem.bytes + mem.bytes / 8 : 0;
+}
+
+/* spill when over --mem-limit, down to seven eighths of it */
+static void check_limit()
+{
+    // spilling rewrites lines in place, which a pending save may be reading
+    if (spill_limit == 0 || mem.bytes <= spill_limit || mem.bytes <= spill_floor ||
+        save_cur != NULL)
+        return;
+
+    spill_cold(spill_limit - spill_limit / 8);
+}
+
+/* Open filename to write the buffer to. Truncating a file that lines
+ * still point into would change them, so that one is written to *tmp
+ * beside it, to be renamed over it when done. */
+static int open_output(const char* filename, char** tmp)
+{
+    struct stat st;
+
+    *tmp = NULL;
+    if (!is_mapped(filename, &st))
+        return open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    *tmp = malloc(strlen(filename) + sizeof(".XXXXXX"));
+    sprintf(*tmp, "%s.XXXXXX", filename);
+
+    int fd = mkstemp(*tmp);
+
+    if (fd == -1) {
+        free(*tmp);
+        *tmp = NULL;
+    } else {
+        fchmod(fd, st.st_mode & 07777);
+    }
+
+    return fd;
+}
+
+/* write all of iov, n entries, to fd; false on an error, with errno set */
+static bool write_iov(int fd, struct iovec* v, int n, size_t* total)
+{
+    size_t want = 0;
+
+    for (int i = 0; i < n; i++)
+        want += v[i].iov_len;
+
+    while (want > 0) {
+        ssize_t r = writev(fd, v, n);
+
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        want -= r;
+        *total += r;
+
+        // short write: skip what went out and retry the rest
+        while (n > 0 && (size_t)r >= v->iov_len) {
+            r -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char*)v->iov_base + r;
+            v->iov_len -= r;
+        }
+    }
+
+    return true;
+}
+
+/* Write the lines from cur up to stop to fd, with their newlines, in
+ * batches of one writev each. Adds what went out to *total; false on a
+ * write error, with errno set. */
+static bool write_lines(int fd, node* cur, node* stop, size_t* total)
+{
+    struct iovec iov[WRITE_BATCH * 2];
+    char* arena = malloc(WRITE_ARENA);
+    int part = 0;
+
+    while (cur != stop) {
+        int n = 0;
+        size_t used = 0;
+
+        for (; cur != stop && n < WRITE_BATCH * 2 - 1; cur = cur->next) {
+            const char* text = NULL;
+
+            // a long line goes out chunk by chunk, over several batches
+            if (cur->kind == T_CHUNKED) {
+                rope* rp = cur->text.rope;
+
+                for (; part < rp->count && n < WRITE_BATCH * 2 - 1; part++) {
+                    iov[n].iov_base = rp->chunks[part]->data;
+                    iov[n++].iov_len = rp->chunks[part]->len;
+                }
+                if (part < rp->count)
+                    break;
+                part = 0;
+            } else if (cur->kind == T_PACKED || cur->kind == T_SPILLED) {
+                // text from a cache may not outlive the next read, copy it
+                if (n > 0 && cur->len > WRITE_ARENA - used)
+                    break;
+                text = line_text(cur);
+                if (cur->len <= WRITE_ARENA - used) {
+                    memcpy(arena + used, text, cur->len);
+                    text = arena + used;
+                    used += cur->len;
+                }
+            } else {
+                text = line_text(cur);
+            }
+
+            if (text != NULL) {
+                iov[n].iov_base = (char*)text;
+                iov[n++].iov_len = cur->len;
+            }
+            if (cur->next != NULL || !buffer.no_eol) {
+                iov[n].iov_base = "\n";
+                iov[n++].iov_len = 1;
+            }
+        }
+
+        if (!write_iov(fd, iov, n, total)) {
+            free(arena);
+            return false;
+        }
+    }
+
+    free(arena);
+    return true;
+}
+
+/* write lines start to end to a file; the buffer counts as saved when
+ * that is all of it */
+static void write_buffer(char* filename, int start, int end)
+{
+    size_t total = 0;
+    char* tmp;
+
+    if (filename == NULL) {
+        error(NO_FILE);
+        return;
+    }
+
+    int fd = open_output(filename, &tmp);
+    if (fd == -1) {
+        fprintf(out, "%s: No such file or directory\n", filename);
+        error(IFILE);
+        return;
+    }
+
+    if (!write_lines(fd, node_at(start), end > 0 ? node_at(end)->next : NULL, &total)) {
+        close(fd);
+        if (tmp != NULL)
+            unlink(tmp);
+        free(tmp);
+        error(IFILE);
+        return;
+    }
+
+    close(fd);
+
+    if (tmp != NULL && rename(tmp, filename) == -1) {
+        fprintf(out, "%s: %s\n", filename, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        error(IFILE);
+        return;
+    }
+
+    free(tmp);
+    fprintf(out, "%zu\n", total);
+    if (start <= 1 && end == buffer.length)
+        buffer.modified = false;
+}
+
+/* open a file for e or r, saying so when it can't be */
+static int open_input(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd == -1) {
+        fprintf(out, "%s: No such file or directory\n", filename);
+        error(IFILE);
+    }
+
+    return fd;
+}
+
+/* a file kept next to path: .name.ext in the same directory */
+static char* sidecar_path(const char* path, const char* ext)
+{
+    const char* slash = strrchr(path, '/');
+    int dir = slash != NULL ? slash + 1 - path : 0;
+    char* spath = malloc(strlen(path) + strlen(ext) + sizeof(".."));
+
+    sprintf(spath, "%.*s.%s.%s", dir, path, path + dir, ext);
+    return spath;
+}
+
+/* what the index of a file with this stat and mapped text should hold */
+static void index_expect(index_head* h, struct stat* st, const char* base, size_t size)
+{
+    uint64_t sum = 14695981039346656037u;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "emidx1\n", 8);
+    h->size = size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ino = st->st_ino;
+
+    for (int i = 0; i < INDEX_SAMPLES; i++) {
+        size_t off = (size - INDEX_SAMPLE) / (INDEX_SAMPLES - 1) * i;
+
+        for (size_t j = 0; j < INDEX_SAMPLE; j++)
+            sum = (sum ^ (unsigned char)base[off + j]) * 1099511628211u;
+    }
+    h->sum = sum;
+}
+
+/* next varint of the index, false at its end or on a bad one */
+static bool index_next(const unsigned char** p, const unsigned char* end, uint64_t* len)
+{
+    *len = 0;
+
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+
+        *len |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80)
+            return true;
+    }
+
+    return false;
+}
+
+/* Check the index of path against the file in mp and map it for sc;
+ * false if there is none, or it is not for this version of the file. */
+static bool index_open(line_scan* sc, const char* path, struct stat* st)
+{
+    char* ipath = sidecar_path(path, "emidx");
+    int fd = open(ipath, O_RDONLY);
+    struct stat ist;
+    index_head want;
+
+    free(ipath);
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &ist) == -1 || ist.st_size < (off_t)sizeof(index_head)) {
+        close(fd);
+        return false;
+    }
+
+    unsigned char* idx = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (idx == MAP_FAILED)
+        return false;
+
+    index_head* h = (index_head*)idx;
+    const unsigned char* end = idx + ist.st_size;
+    const unsigned char* p = idx + sizeof(index_head);
+    uint64_t len, lines = 0, bytes = 0;
+    bool ok;
+
+    index_expect(&want, st, sc->mp->base, sc->mp->size);
+    ok = memcmp(h, &want, offsetof(index_head, lines)) == 0 && h->no_eol <= 1;
+
+    // check it adds up before any line is taken from it
+    while (ok && p < end && index_next(&p, end, &len)) {
+        lines++;
+        bytes += len + 1;
+    }
+    ok = ok && p == end && lines == h->lines && bytes - h->no_eol == sc->mp->size;
+
+    if (!ok) {
+        munmap(idx, ist.st_size);
+        return false;
+    }
+
+    sc->idx = idx;
+    sc->idx_size = ist.st_size;
+    sc->ip = idx + sizeof(index_head);
+    sc->no_eol = h->no_eol;
+    return true;
+}
+
+/* Start an index of path to be written as sc finds the lines. It goes
+ * to a temporary file renamed over the old one when the scan is done; a
+ * directory that can't be written to is no error, the file is just
+ * scanned again next time. */
+static void index_create(line_scan* sc, const char* path, struct stat* st)
+{
+    char* ipath = sidecar_path(path, "emidx");
+    int fd;
+
+    sc->tmp = malloc(strlen(ipath) + sizeof(".XXXXXX"));
+    sprintf(sc->tmp, "%s.XXXXXX", ipath);
+    free(ipath);
+
+    if ((fd = mkstemp(sc->tmp)) != -1 && (sc->out = fdopen(fd, "w")) != NULL) {
+        // readable by whoever can read the file, not mkstemp's 0600
+        mode_t mask = umask(0);
+
+        umask(mask);
+        fchmod(fd, st->st_mode & 0666 & ~mask);
+        index_expect(&sc->head, st, sc->mp->base, sc->mp->size);
+        fwrite(&sc->head, sizeof(index_head), 1, sc->out);
+        return;
+    }
+
+    if (fd != -1) {
+        close(fd);
+        unlink(sc->tmp);
+    }
+    free(sc->tmp);
+    sc->tmp = NULL;
+}
+
+/* Get ready to find the lines of mp, the mapping of the file at path,
+ * or of an unnamed one when path is NULL. Large files keep an index of
+ * their lines next to them, which is read instead of looking for the
+ * newlines when it is still good, and written when it is not. */
+static void scan_start(line_scan* sc, map* mp, const char* path, struct stat* st)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->mp = mp;
+
+    if (path != NULL && mp->size >= INDEX_MIN && !index_open(sc, path, st))
+        index_create(sc, path, st);
+}
+
+/* the next line of the file; false after the last one */
+static bool scan_line(line_scan* sc, size_t* off, size_t* len)
+{
+    uint64_t n;
+
+    if (sc->idx != NULL) {
+        if (!index_next(&sc->ip, sc->idx + sc->idx_size, &n))
+            return false;
+
+        *off = sc->off;
+        *len = n;
+        sc->off += n + 1;
+        return true;
+    }
+
+    if (sc->off >= sc->mp->size)
+        return false;
+
+    const char* base = sc->mp->base;
+    const char* nl = memchr(base + sc->off, '\n', sc->mp->size - sc->off);
+
+    *off = sc->off;
+    *len = nl != NULL ? (size_t)(nl - base) - sc->off : sc->mp->size - sc->off;
+    sc->off += *len + 1;
+    if (nl == NULL)
+        sc->no_eol = true;
+
+    if (sc->out != NULL) {
+        for (n = *len; n >= 0x80; n >>= 7)
+            putc(0x80 | (n & 0x7f), sc->out);
+        putc(n, sc->out);
+        sc->head.lines++;
+    }
+
+    return true;
+}
+
+/* Let go of what the scan used. An index being written is put in place
+ * if the scan got to the end of the file, else dropped. */
+static void scan_end(line_scan* sc)
+{
+    if (sc->idx != NULL)
+        munmap((void*)sc->idx, sc->idx_size);
+
+    if (sc->out == NULL)
+        return;
+
+    bool whole = sc->off >= sc->mp->size;
+
+    sc->head.no_eol = sc->no_eol;
+    whole = whole && fseek(sc->out, 0, SEEK_SET) == 0 &&
+            fwrite(&sc->head, sizeof(index_head), 1, sc->out) == 1;
+
+    if (fclose(sc->out) != 0 || !whole) {
+        unlink(sc->tmp);
+    } else {
+        char* ipath = strndup(sc->tmp, strlen(sc->tmp) - strlen(".XXXXXX"));
+
+        if (rename(sc->tmp, ipath) == -1)
+            unlink(sc->tmp);
+        free(ipath);
+    }
+
+    free(sc->tmp);
+}
+
+/* The loader thread: finds the lines of the file in load_scan and sends
+ * their nodes over in batches, the last one marked done. */
+static void* load_run(void* arg)
+{
+    line_scan* sc = arg;
+    bool more = true;
+
+    while (more) {
+        load_batch* b = calloc(1, sizeof(load_batch));
+        size_t off, len;
+
+        init_list(&b->lines);
+        while (b->lines.length < LOAD_BATCH && !atomic_load(&load_stop) &&
+               (more = scan_line(sc, &off, &len))) {
+            append_node(&b->lines, alloc_mapped(sc->mp, off, len));
+            b->bytes += alloc_size(node_size(T_MAPPED, len));
+            b->plain_bytes += plain_size(len);
+        }
+
+        more = more && !atomic_load(&load_stop);
+        b->end = sc->off;
+        b->done = !more;
+        b->no_eol = sc->no_eol;
+        if (!more)
+            scan_end(sc);
+
+        while (write(load_pipe[1], &b, sizeof(b)) == -1 && errno == EINTR)
+            ;
+    }
+
+    return NULL;
+}
+
+/* Start loading the lines of mp into the buffer in the background; false
+ * if no thread can be had for it. The loader holds a reference to the
+ * mapping until it is done, whatever happens to its lines. */
+static bool load_start(map* mp, const char* path, struct stat* st)
+{
+    if (pipe(load_pipe) == -1)
+        return false;
+
+    fcntl(load_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(load_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(load_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    scan_start(&load_scan, mp, path, st);
+    atomic_store(&load_stop, false);
+
+    if (pthread_create(&load_thread, NULL, load_run, &load_scan) != 0) {
+        scan_end(&load_scan);
+        close(load_pipe[0]);
+        close(load_pipe[1]);
+        return false;
+    }
+
+    mp->refs++;
+    load_map = mp;
+    load_off = 0;
+    loading = true;
+    return true;
+}
+
+/* Take in the batches the loader has sent so far, adding them to the end
+ * of the buffer, or throwing them away when keep is false. */
+static void load_take(bool keep)
+{
+    load_batch* b;
+
+    ssize_t r;
+
+    while (loading && ((r = read(load_pipe[0], &b, sizeof(b))) == sizeof(b) || (r == -1 && errno == EINTR))) {
+        if (r != sizeof(b))
+            continue;
+
+        list* lst = &b->lines;
+
+        if (keep && lst->length > 0) {
+            lst->first->prev = buffer.last;
+            if (buffer.last != NULL)
+                buffer.last->next = lst->first;
+            else
+                buffer.first = lst->first;
+            buffer.last = lst->last;
+
+            // . follows the end of the file in, as if it was read at once
+            if (current_line == buffer.length)
+                current_line += lst->length;
+            buffer.length += lst->length;
+
+            load_map->refs += lst->length;
+            mem.lines[T_MAPPED] += lst->length;
+            mem.bytes += b->bytes;
+            mem.plain_bytes += b->plain_bytes;
+        } else {
+            for (node* cur = lst->first, *next; cur != NULL; cur = next) {
+                next = cur->next;
+                free(cur);
+            }
+        }
+
+        load_off = b->end;
+
+        if (b->done) {
+            if (keep)
+                buffer.no_eol = b->no_eol;
+
+            pthread_join(load_thread, NULL);
+            close(load_pipe[0]);
+            close(load_pipe[1]);
+            release_map(load_map);
+            loading = false;
+        }
+
+        free(b);
+    }
+}
+
+/* wait for the buffer to have line num, or the load to finish */
+static void load_wait(int num)
+{
+    while (loading && buffer.length < num) {
+        struct pollfd pfd = { load_pipe[0], POLLIN, 0 };
+
+        poll(&pfd, 1, -1);
+        load_take(true);
+    }
+}
+
+/* stop a background load, dropping the lines not yet taken in */
+static void load_cancel()
+{
+    if (!loading)
+        return;
+
+    atomic_store(&load_stop, true);
+
+    while (loading) {
+        struct pollfd pfd = { load_pipe[0], POLLIN, 0 };
+
+        poll(&pfd, 1, -1);
+        load_take(false);
+    }
+}
+
+/* Add the lines of a regular file to lst as nodes pointing into a
+ * private mapping of it, nothing is copied; false if it can't be mapped.
+ * path names the file for its index, or is NULL. With -a, the lines of
+ * the buffer are left to the loader thread. */
+static bool map_lines(int fd, const char* path, list* lst, size_t* total)
+{
+    struct stat st;
+
+    if (!map_guarded || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+
+    // writable, so that map_detach can make its pages private
+    char* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    map* mp = malloc(sizeof(map));
+    mp->refs = 0;
+    mp->base = base;
+    mp->size = st.st_size;
+    mp->dev = st.st_dev;
+    mp->ino = st.st_ino;
+    mp->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    mp->mtime = st.st_mtim;
+    mp->path = strdup(path != NULL ? path : "file");
+    mp->next = maps;
+    maps = mp;
+    mem.maps++;
+    mem.bytes += alloc_size(sizeof(map));
+
+    *total = mp->size;
+
+    // the buffer can fill in while the prompt is up
+    if (async_load && lst == &buffer && load_start(mp, path, &st))
+        return true;
+
+    line_scan sc;
+    size_t off, len;
+
+    scan_start(&sc, mp, path, &st);
+    while (scan_line(&sc, &off, &len))
+        append_node(lst, new_mapped(mp, off, len));
+    lst->no_eol = sc.no_eol;
+    scan_end(&sc);
+    return true;
+}
+
+/* make sure at least one full line (or the rest of the input) is buffered */
+static bool reader_fill(reader* rd)
+{
+    while (!rd->eof && (rd->start == rd->end ||
+                        memchr(rd->buf + rd->start, '\n', rd->end - rd->start) == NULL)) {
+        if (rd->start > 0) {
+            memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+            rd->end -= rd->start;
+            rd->start = 0;
+        }
+
+        if (rd->cap - rd->end < READ_BLOCK) {
+            rd->cap = rd->cap == 0 ? READ_BLOCK * 4 : rd->cap * 2;
+            rd->buf = realloc(rd->buf, rd->cap);
+        }
+
+        // keep a spare byte so the last line can always be terminated
+        ssize_t r = read(rd->fd, rd->buf + rd->end, rd->cap - rd->end - 1);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            rd->eof = true;
+        else
+            rd->end += r;
+    }
+
+    return rd->start < rd->end;
+}
+
+/* return the next line from the reader, NUL terminated in place. The
+ * pointer is only valid until the next call. */
+static char* reader_line(reader* rd, size_t* len)
+{
+    if (!reader_fill(rd))
+        return NULL;
+
+    char* line = rd->buf + rd->start;
+    char* nl = memchr(line, '\n', rd->end - rd->start);
+
+    rd->partial = nl == NULL;
+    if (nl == NULL)
+        nl = rd->buf + rd->end;
+
+    *len = nl - line;
+    *nl = 0;
+    rd->start += *len + 1;
+
+    if (rd->start > rd->end)
+        rd->start = rd->end;
+
+    return line;
+}
+
+/* Read the lines of a file into lst and close it; returns the bytes
+ * read. Regular files are mapped unless lines are to be interned,
+ * packed or spilled, which needs them on the heap, or the file is
+ * followed: a mapping of a file that is truncated under us faults.
+ * path names the file for its index, or is NULL. */
+static size_t load_lines(int fd, const char* path, list* lst)
+{
+    reader rd = { .fd = fd };
+    size_t total = 0;
+    char* line;
+    size_t len;
+
+    if (!interning && !packing && spill_limit == 0 && !following &&
+        map_lines(fd, path, lst, &total)) {
+        close(fd);
+        return total;
+    }
+
+    while ((line = reader_line(&rd, &len)) != NULL) {
+        total += len + !rd.partial;
+        if (rd.partial)
+            lst->no_eol = true;
+
+        append_node(lst, new_node(line, len));
+
+        if (lst == &buffer && buffer.length % SPILL_CHECK == 0)
+            check_limit();
+    }
+
+    free(rd.buf);
+    close(fd);
+    return total;
+}
+
+/* Follow path from the start: its directory is watched, so a file that
+ * is rotated away or not there yet is picked up when it appears. fd is
+ * the file as opened now, or -1. */
+static void follow_watch(const char* path, int fd)
+{
+    const char* slash = strrchr(path, '/');
+    size_t base = slash != NULL ? slash + 1 - path : 0;
+    char* dir = slash == NULL ? strdup(".") :
+                slash == path ? strdup("/") : strndup(path, slash - path);
+    struct stat st;
+
+    if (follow_fd == -1)
+        follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow_fd != -1 && follow_wd != -1)
+        inotify_rm_watch(follow_fd, follow_wd);
+    if (follow_fd != -1)
+        follow_wd = inotify_add_watch(follow_fd, dir, IN_MODIFY | IN_CREATE | IN_DELETE |
+                                                      IN_MOVED_FROM | IN_MOVED_TO);
+
+    // path may be follow_path itself when reloading
+    char* copy = strdup(path);
+
+    free(dir);
+    free(follow_path);
+    follow_path = copy;
+    follow_name = copy + base;
+
+    follow_dev = 0;
+    follow_ino = 0;
+    follow_off = 0;
+    if (fd != -1 && fstat(fd, &st) == 0) {
+        follow_dev = st.st_dev;
+        follow_ino = st.st_ino;
+    }
+}
+
+/* read file into a doubly linked list of lines, replacing the buffer;
+ * false if it can't be opened */
+static bool read_file(char* filename)
+{
+    int fd = open_input(filename);
+
+    if (following)
+        follow_watch(filename, fd);
+
+    if (fd == -1)
+        return false;
+
+    load_cancel();
+    clear_buffer();
+
+    size_t total = load_lines(fd, filename, &buffer);
+
+    if (following)
+        follow_off = total;
+
+    current_line = buffer.length;
+    buffer.modified = false;
+
+    fprintf(out, "%zu\n", total);
+    return true;
+}
+
+static int resolve(addr a)
+{
+    switch (a.kind) {
+        case A_LINE:
+            return a.offset;
+        case A_CURRENT:
+            return current_line + a.offset;
+        case A_LAST:
+            return buffer.length + a.offset;
+        default:
+            return -1;
+    }
+}
+
+enum char_class_t {
+    C_OTHER,
+    C_DIGIT,
+    C_BASE,
+    C_OFFSET,
+    C_SEP,
+    C_BLANK
+};
+
+/* lexical classes of the characters that can make up an address */
+static const unsigned char char_class[256] = {
+    ['0'] = C_DIGIT, ['1'] = C_DIGIT, ['2'] = C_DIGIT, ['3'] = C_DIGIT,
+    ['4'] = C_DIGIT, ['5'] = C_DIGIT, ['6'] = C_DIGIT, ['7'] = C_DIGIT,
+    ['8'] = C_DIGIT, ['9'] = C_DIGIT,
+    ['.'] = C_BASE, ['$'] = C_BASE,
+    ['+'] = C_OFFSET, ['-'] = C_OFFSET, ['^'] = C_OFFSET,
+    [','] = C_SEP, [';'] = C_SEP,
+    [' '] = C_BLANK, ['\t'] = C_BLANK
+};
+
+#define CLASS(c) (char_class[(unsigned char)(c)])
+
+static const char* skip_blanks(const char* p)
+{
+    while (CLASS(*p) == C_BLANK)
+        p++;
+
+    return p;
+}
+
+static bool lex_number(const char** p, int* num)
+{
+    long n = 0;
+    const char* s = *p;
+
+    while (CLASS(*s) == C_DIGIT) {
+        n = n * 10 + (*s++ - '0');
+        if (n > INT_MAX)
+            return false;
+    }
+
+    *num = n;
+    *p = s;
+    return true;
+}
+
+/* Lex one address: an optional base (number, '.' or '$') followed by any
+ * number of offsets ("+n", "-n", "^n", or a bare sign meaning 1). A
+ * missing base with an offset is relative to '.'. Returns 1 when an
+ * address was read, 0 when there was none and -1 on error. */
+static int lex_addr(const char** p, addr* a)
+{
+    const char* s = skip_blanks(*p);
+    bool found = true;
+    long offset = 0;
+    int num;
+
+    switch (CLASS(*s)) {
+        case C_DIGIT:
+            if (!lex_number(&s, &num))
+                return -1;
+            a->kind = A_LINE;
+            offset = num;
+            break;
+        case C_BASE:
+            a->kind = *s++ == '.' ? A_CURRENT : A_LAST;
+            break;
+        case C_OFFSET:
+            a->kind = A_CURRENT;
+            break;
+        default:
+            found = false;
+    }
+
+    for (;;) {
+        s = skip_blanks(s);
+
+        if (CLASS(*s) == C_OFFSET) {
+            int sign = *s++ == '+' ? 1 : -1;
+
+            num = 1;
+            if (CLASS(*s) == C_DIGIT && !lex_number(&s, &num))
+                return -1;
+
+            offset += sign * num;
+        } else if (CLASS(*s) == C_DIGIT && found) {
+            // "addr n" is read as "addr+n"
+            if (!lex_number(&s, &num))
+                return -1;
+
+            offset += num;
+        } else {
+            break;
+        }
+
+        found = true;
+        if (offset > INT_MAX || offset < INT_MIN)
+            return -1;
+    }
+
+    if (!found)
+        return 0;
+
+    a->offset = offset;
+    *p = s;
+    return 1;
+}
+
+/* Single pass lexer for a command line: the full ed address list followed
+ * by the command letter and its argument. Separators may be repeated and
+ * only the last two addresses are kept. ',' and ';' with a missing first
+ * address default to 1 and '.', a missing second address to '$'. */
+static char parse(const char* line, command* cmd)
+{
+    const char* p = line;
+    bool pending = false;
+    int count = 0;
+    addr a;
+
+    cmd->start = cmd->end = cmd->dest = (addr){A_NONE, 0};
+    cmd->dest_buf = 0;
+    cmd->chain = false;
+    cmd->fault = ADDR;
+    cmd->arg = NULL;
+
+    for (;;) {
+        int r = lex_addr(&p, &a);
+
+        if (r < 0)
+            return 0;
+
+        p = skip_blanks(p);
+
+        if (r == 0 && !pending && CLASS(*p) != C_SEP)
+            break;
+
+        if (r == 0)
+            a = *p == ',' ? (addr){A_LINE, 1} : (pending ? (addr){A_LAST, 0} : (addr){A_CURRENT, 0});
+
+        cmd->start = cmd->end;
+        cmd->end = a;
+        count++;
+
+        if (CLASS(*p) != C_SEP)
+            break;
+
+        cmd->chain = *p++ == ';';
+        pending = true;
+    }
+
+    if (count == 1) {
+        cmd->start = cmd->end;
+        cmd->end = (addr){A_NONE, 0};
+    }
+
+    cmd->fault = CMD;
+
+    // a bare newline prints the next line
+    if (*p == 0)
+        cmd->start = count > 0 ? cmd->start : (addr){A_CURRENT, 1};
+
+    char name = *p != 0 ? *p++ : 'p';
+
+    if (strchr(commands, name) == NULL)
+        return 0;
+
+    // m and t take a line to put the lines after, in another buffer
+    // when it starts with the buffer's number and a colon
+    if (name == 'm' || name == 't') {
+        const char* s = skip_blanks(p);
+        int num;
+
+        if (CLASS(*s) == C_DIGIT && lex_number(&s, &num) && *s == ':') {
+            if (num == 0)
+                return 0;
+            cmd->dest_buf = num;
+            p = s + 1;
+        }
+
+        cmd->dest = (addr){A_CURRENT, 0};
+        if (lex_addr(&p, &cmd->dest) < 0)
+            return 0;
+    }
+
+    p = skip_blanks(p);
+    if (*p != 0) {
+        if (strchr("ewrsb", name) == NULL)
+            return 0;
+        cmd->arg = (char*)p;
+    }
+
+    return name;
+}
+
+/* free lines that were not put in the buffer after all */
+static void drop_text(list* lst)
+{
+    if (lst == NULL)
+        return;
+
+    for (node* cur = lst->first, *next; cur != NULL; cur = next) {
+        next = cur->next;
+        free_node(cur);
+    }
+    free(lst);
+}
+
+/* splice lst into the buffer after line num, consuming the list */
+static int insert_into_buffer(list* lst, int num)
+{
+    if (lst == NULL)
+        return 0;
+
+    journal_insert(num, lst);
+
+    node* before = node_at(num);
+    node* after = before != NULL ? before->next : buffer.first;
+
+    lst->first->prev = before;
+    lst->last->next = after;
+
+    if (before != NULL)
+        before->next = lst->first;
+    else
+        buffer.first = lst->first;
+
+    if (after != NULL)
+        after->prev = lst->last;
+    else
+        buffer.last = lst->last;
+
+    // lines added at the end get their newlines back
+    if (after == NULL)
+        buffer.no_eol = false;
+
+    buffer.length += lst->length;
+    buffer.modified = true;
+    int wrote = lst->length;
+
+    free(lst);
+
+    return wrote;
+}
+
+/* the r command: the lines of a file go in after line num in one splice */
+static void read_into(int num, char* filename)
+{
+    if (num > buffer.length) {
+        error(ADDR);
+        return;
+    }
+
+    int fd = open_input(filename);
+
+    if (fd == -1)
+        return;
+
+    list* lst = malloc(sizeof(list));
+    init_list(lst);
+
+    size_t total = load_lines(fd, filename, lst);
+    bool no_eol = lst->no_eol;
+
+    if (lst->length > 0) {
+        bool at_end = num == buffer.length;
+
+        current_line = num + insert_into_buffer(lst, num);
+        if (at_end)
+            buffer.no_eol = no_eol;
+        asked = false;
+    } else {
+        free(lst);
+    }
+
+    fprintf(out, "%zu\n", total);
+}
+
+/* put nd in the place of old, which is freed */
+static void replace_node(node* old, node* nd)
+{
+    nd->prev = old->prev;
+    nd->next = old->next;
+
+    if (nd->prev != NULL)
+        nd->prev->next = nd;
+    else
+        buffer.first = nd;
+
+    if (nd->next != NULL)
+        nd->next->prev = nd;
+    else
+        buffer.last = nd;
+
+    free_node(old);
+}
+
+/* A node with the text of nd. Text that is counted, interned, packed,
+ * spilled or mapped, is pointed to again instead of copied; the chunks
+ * of a long line are edited in place, so those are copied. */
+static node* copy_node(node* nd)
+{
+    if (nd->kind == T_INLINE || nd->kind == T_CHUNKED)
+        return new_node(line_text(nd), nd->len);
+
+    if (nd->kind == T_MAPPED)
+        return new_mapped(nd->text.mapped.map, nd->text.mapped.offset, nd->len);
+
+    size_t size = node_size(nd->kind, nd->len);
+    node* cp = malloc(size);
+
+    memcpy(cp, nd, size);
+    if (nd->kind == T_SHARED)
+        ((shared*)(nd->text.ptr - offsetof(shared, text)))->refs++;
+    else if (nd->kind == T_PACKED)
+        nd->text.packed.pack->refs++;
+
+    mem.lines[nd->kind]++;
+    mem.bytes += alloc_size(size);
+    mem.plain_bytes += plain_size(nd->len);
+    return cp;
+}
+
+/* Copies of lines start to end, for t. A line of INLINE_SIZE or more
+ * held in its node is moved to an interned copy first, which the copy
+ * shares, and so do any made later. */
+static list* copy_lines(int start, int end)
+{
+    list* lst = malloc(sizeof(list));
+    node* cur = node_at(start);
+
+    init_list(lst);
+    for (int num = start; num <= end; num++) {
+        node* next = cur->next;
+
+        if (cur->kind == T_INLINE && cur->len >= INLINE_SIZE) {
+            node* nd = make_node(T_SHARED, cur->text.buf, cur->len);
+
+            replace_node(cur, nd);
+            cur = nd;
+        }
+
+        append_node(lst, copy_node(cur));
+        cur = next;
+    }
+
+    return lst;
+}
+
+/* take lines start to end out of the buffer for m, as a list of the
+ * same nodes */
+static list* detach_range(int start, int end)
+{
+    list* lst = malloc(sizeof(list));
+    node* first = node_at(start);
+    node* last = first;
+
+    journal_delete(start, end);
+
+    for (int num = start; num < end; num++)
+        last = last->next;
+
+    // the sweeps are not to follow them out of the buffer
+    for (node* cur = first; cur != last->next; cur = cur->next) {
+        if (cur == pack_cursor)
+            pack_cursor = last->next;
+        if (cur == spill_cursor)
+            spill_cursor = last->next;
+    }
+
+    if (first->prev != NULL)
+        first->prev->next = last->next;
+    else
+        buffer.first = last->next;
+
+    if (last->next != NULL) {
+        last->next->prev = first->prev;
+    } else {
+        buffer.last = first->prev;
+        buffer.no_eol = false;
+    }
+
+    init_list(lst);
+    first->prev = NULL;
+    last->next = NULL;
+    lst->first = first;
+    lst->last = last;
+    lst->length = end - start + 1;
+
+    buffer.length -= lst->length;
+    if (current_line > buffer.length)
+        current_line = buffer.length;
+
+    buffer.modified = true;
+    asked = false;
+    return lst;
+}
+
+static void subst_put(const char* text, size_t len)
+{
+    if (subst_len + len > subst_cap) {
+        subst_cap = subst_len + len > 2 * subst_cap ? subst_len + len : 2 * subst_cap;
+        subst_out = realloc(subst_out, subst_cap);
+    }
+
+    memcpy(subst_out + subst_len, text, len);
+    subst_len += len;
+}
+
+/* append the replacement for a match: & is the match, \1 to \9 its
+ * groups, and any other escaped character stands for itself */
+static void expand(const char* repl, const char* text, regmatch_t* m)
+{
+    for (const char* r = repl; *r; r++) {
+        if (*r == '&' || (*r == '\\' && r[1] >= '1' && r[1] <= '9')) {
+            int g = *r == '&' ? 0 : *++r - '0';
+
+            if (m[g].rm_so >= 0)
+                subst_put(text + m[g].rm_so, m[g].rm_eo - m[g].rm_so);
+        } else {
+            if (*r == '\\' && r[1] != 0)
+                r++;
+            subst_put(r, 1);
+        }
+    }
+}
+
+/* split an s argument "/re/repl/flags" in place, dropping the escapes
+ * of the delimiter; a missing last delimiter means print */
+static bool split_subst(char* arg, char** re, char** repl, bool* global, int* nth, bool* show)
+{
+    char delim = *arg;
+    char* parts[2];
+    char* p = arg + 1;
+
+    if (delim == 0 || delim == ' ' || delim == '\\')
+        return false;
+
+    for (int i = 0; i < 2; i++) {
+        char* out = p;
+
+        parts[i] = p;
+        for (; *p && *p != delim; p++) {
+            if (*p == '\\' && p[1] == delim)
+                p++;
+            else if (*p == '\\' && p[1] != 0)
+                *out++ = *p++;
+            *out++ = *p;
+        }
+
+        if (*p == 0 && i == 0)
+            return false;
+
+        bool last = *p == 0;
+
+        *out = 0;
+        if (!last)
+            p++;
+        if (last) {
+            *show = true;
+            break;
+        }
+    }
+
+    *re = parts[0];
+    *repl = parts[1];
+
+    for (; *p; p++) {
+        if (*p == 'g') {
+            *global = true;
+        } else if (*p == 'p') {
+            *show = true;
+        } else if (*p >= '1' && *p <= '9') {
+            *nth = strtol(p, &p, 10);
+            p--;
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* note a match to replace, with its replacement in subst_out */
+static void add_edit(size_t found, size_t so, size_t eo, const char* repl, const char* text,
+                     regmatch_t* m)
+{
+    if (3 * (found + 1) > subst_edits_cap) {
+        subst_edits_cap = subst_edits_cap == 0 ? 48 : subst_edits_cap * 2;
+        subst_edits = realloc(subst_edits, subst_edits_cap * sizeof(size_t));
+    }
+
+    subst_edits[3 * found] = so;
+    subst_edits[3 * found + 1] = eo;
+    subst_edits[3 * found + 2] = subst_len;
+    expand(repl, text, m);
+}
+
+/* Find the matches to replace in a line, the nth or from the nth on.
+ * subst_edits gets the offsets of each and where its replacement starts
+ * in subst_out, three to an edit. */
+static size_t find_matches(const char* text, size_t len, const char* repl, bool global, int nth)
+{
+    size_t pos = 0;
+    size_t found = 0;
+    size_t prev_end = (size_t)-1;
+    int count = 0;
+
+    subst_len = 0;
+
+    while (pos <= len) {
+        const char* base = text + pos;
+        regmatch_t m[10];
+
+        m[0].rm_so = 0;
+        m[0].rm_eo = len - pos;
+        if (regexec(&subst_re, base, 10, m, REG_STARTEND | (pos > 0 ? REG_NOTBOL : 0)) != 0)
+            break;
+
+        size_t so = pos + m[0].rm_so;
+        size_t eo = pos + m[0].rm_eo;
+
+        pos = eo > so ? eo : eo + 1;
+
+        // an empty match right after the last match does not count
+        if (so == eo && so == prev_end)
+            continue;
+        prev_end = eo;
+
+        if (++count < nth)
+            continue;
+
+        add_edit(found++, so, eo, repl, base, m);
+        if (!global)
+            break;
+    }
+
+    return found;
+}
+
+/* the first copy of the n bytes of pat in text, by Horspool's method */
+static char* find_bytes(const char* text, size_t len, const char* pat, size_t n)
+{
+    size_t skip[256];
+
+    if (n == 0 || n > len)
+        return NULL;
+
+    for (int c = 0; c < 256; c++)
+        skip[c] = n;
+    for (size_t i = 0; i + 1 < n; i++)
+        skip[(unsigned char)pat[i]] = n - 1 - i;
+
+    for (const char* p = text; p <= text + len - n; p += skip[(unsigned char)p[n - 1]])
+        if (p[n - 1] == pat[n - 1] && memcmp(p, pat, n - 1) == 0)
+            return (char*)p;
+
+    return NULL;
+}
+
+/* copy n bytes of a long line from off */
+static void rope_copy(rope* rp, size_t off, size_t n, char* dst)
+{
+    for (int i = rope_find(rp, off); n > 0; i++) {
+        chunk* ch = rp->chunks[i];
+        size_t at = off - (rp->ends[i] - ch->len);
+        size_t k = ch->len - at < n ? ch->len - at : n;
+
+        memcpy(dst, ch->data + at, k);
+        dst += k;
+        off += k;
+        n -= k;
+    }
+}
+
+/* the first place from off where a long line has the n bytes of pat,
+ * looking at the chunks where they are, or -1 */
+static size_t rope_search(rope* rp, size_t len, size_t off, const char* pat, size_t n)
+{
+    char* seam = malloc(2 * n);
+    size_t hit = (size_t)-1;
+
+    for (int i = rope_find(rp, off); i < rp->count && hit == (size_t)-1; i++) {
+        chunk* ch = rp->chunks[i];
+        size_t base = rp->ends[i] - ch->len;
+        size_t at = off > base ? off - base : 0;
+        char* p = find_bytes(ch->data + at, ch->len - at, pat, n);
+
+        if (p != NULL) {
+            hit = base + (p - ch->data);
+            break;
+        }
+
+        // a match across the end of the chunk
+        size_t end = rp->ends[i];
+        size_t from = end - (n - 1 < end - base - at ? n - 1 : end - base - at);
+        size_t to = len - end < n - 1 ? len : end + n - 1;
+
+        if (n < 2 || to == end)
+            continue;
+
+        rope_copy(rp, from, to - from, seam);
+        p = find_bytes(seam, to - from, pat, n);
+        if (p != NULL && from + (p - seam) < end)
+            hit = from + (p - seam);
+    }
+
+    free(seam);
+    return hit;
+}
+
+/* find_matches() for a pattern without special characters in a long
+ * line, so that it never has to be put together in one piece */
+static size_t find_literal(rope* rp, size_t len, const char* repl, bool global, int nth)
+{
+    size_t n = strlen(subst_literal);
+    size_t pos = 0;
+    size_t found = 0;
+    int count = 0;
+    regmatch_t m[10];
+
+    subst_len = 0;
+    m[0].rm_so = 0;
+    m[0].rm_eo = n;
+    for (int i = 1; i < 10; i++)
+        m[i].rm_so = m[i].rm_eo = -1;
+
+    while (pos + n <= len) {
+        size_t so = rope_search(rp, len, pos, subst_literal, n);
+
+        if (so == (size_t)-1)
+            break;
+        pos = so + n;
+
+        if (++count < nth)
+            continue;
+
+        add_edit(found++, so, so + n, repl, subst_literal, m);
+        if (!global)
+            break;
+    }
+
+    return found;
+}
+
+/* Replace the matches in one line. A long line that stays long is
+ * spliced in place when there are few edits, so only the chunks around
+ * them are copied; otherwise the line is built anew. */
+static void subst_line(node* nd, const char* text, size_t found)
+{
+    size_t* edits = subst_edits;
+    size_t len = nd->len;
+    size_t new_len = len + subst_len;
+
+    for (size_t i = 0; i < found; i++)
+        new_len -= edits[3 * i + 1] - edits[3 * i];
+
+    if (nd->kind == T_CHUNKED && new_len >= CHUNK_MIN && found * CHUNK_SIZE < len) {
+        // last match first, the offsets of the others stay good
+        for (size_t i = found; i-- > 0; ) {
+            size_t at = edits[3 * i + 2];
+            size_t end = i + 1 < found ? edits[3 * i + 5] : subst_len;
+
+            rope_splice(nd->text.rope, edits[3 * i], edits[3 * i + 1] - edits[3 * i],
+                        subst_out + at, end - at);
+        }
+
+        mem.plain_bytes += plain_size(new_len) - plain_size(len);
+        nd->len = new_len;
+        return;
+    }
+
+    if (text == NULL)
+        text = line_text(nd);
+
+    char* out = malloc(new_len + 1);
+    size_t done = 0;
+    size_t used = 0;
+
+    for (size_t i = 0; i < found; i++) {
+        size_t so = edits[3 * i];
+        size_t at = edits[3 * i + 2];
+        size_t end = i + 1 < found ? edits[3 * i + 5] : subst_len;
+
+        memcpy(out + used, text + done, so - done);
+        used += so - done;
+        memcpy(out + used, subst_out + at, end - at);
+        used += end - at;
+        done = edits[3 * i + 1];
+    }
+
+    memcpy(out + used, text + done, len - done);
+    replace_node(nd, new_node(out, new_len));
+    free(out);
+}
+
+/* Do the substitution of an s command on lines start to end. Returns
+ * the last line changed, 0 if none, or -1 after reporting bad arguments;
+ * *show is set by the p flag. */
+static int subst_lines(int start, int end, const char* arg, bool* show)
+{
+    char *re, *repl;
+    bool global = false;
+    int nth = 1;
+
+    *show = false;
+
+    if (buffer.first == NULL || start < 1 || start > end || end > buffer.length) {
+        error(ADDR);
+        return -1;
+    }
+
+    if (arg == NULL && subst_last == NULL) {
+        error(NO_PATTERN);
+        return -1;
+    }
+
+    if (arg != NULL && arg != subst_last) {
+        free(subst_last);
+        subst_last = strdup(arg);
+    }
+
+    char* spec = strdup(subst_last);
+
+    if (!split_subst(spec, &re, &repl, &global, &nth, show)) {
+        free(spec);
+        error(BAD_PATTERN);
+        return -1;
+    }
+
+    if (*re != 0) {
+        if (have_pattern)
+            regfree(&subst_re);
+        free(subst_literal);
+        subst_literal = strpbrk(re, ".[\\*^$") == NULL ? strdup(re) : NULL;
+        have_pattern = regcomp(&subst_re, re, 0) == 0;
+        if (!have_pattern) {
+            free(spec);
+            error(BAD_PATTERN);
+            return -1;
+        }
+    } else if (!have_pattern) {
+        free(spec);
+        error(NO_PATTERN);
+        return -1;
+    }
+
+    int last = 0;
+    node* cur = node_at(start);
+
+    for (int line_num = start; line_num <= end; line_num++) {
+        node* next = cur->next;
+        const char* text = NULL;
+        size_t found;
+
+        if (cur->kind == T_CHUNKED && subst_literal != NULL) {
+            found = find_literal(cur->text.rope, cur->len, repl, global, nth);
+        } else {
+            text = flat_text(cur);
+            found = find_matches(text, cur->len, repl, global, nth);
+        }
+
+        if (found > 0) {
+            subst_line(cur, text, found);
+            journal_subst(line_num, found);
+            last = line_num;
+        }
+        cur = next;
+    }
+
+    free(spec);
+
+    // the copy of a long line is not worth keeping around
+    if (flat_cap > CHUNK_MIN) {
+        free(flat);
+        flat = NULL;
+        flat_cap = 0;
+    }
+
+    if (last > 0) {
+        buffer.modified = true;
+        asked = false;
+    }
+
+    return last;
+}
+
+/* the s command, ed style: [range]s/re/repl/[g][n][p]; an empty re is
+ * the last one used and a bare s repeats the last substitution */
+static void substitute(int start, int end, const char* arg)
+{
+    bool show;
+    int last = subst_lines(start, end, arg, &show);
+
+    if (last < 0)
+        return;
+
+    if (last == 0) {
+        error(NO_MATCH);
+        return;
+    }
+
+    current_line = last;
+    if (show)
+        print_range(last, last, false);
+}
+
+/* Hold off SIGPIPE in this thread while writing to a pipe whose reader
+ * may be gone, so the write fails with EPIPE instead; the disposition
+ * is the host's and is left alone. */
+static void pipe_hold(sigset_t* old)
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+/* undo pipe_hold, taking away a SIGPIPE the writes left pending */
+static void pipe_release(sigset_t* old)
+{
+    sigset_t set, pending;
+    struct timespec now = { 0, 0 };
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    if (!sigismember(old, SIGPIPE) && sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE))
+        while (sigtimedwait(&set, NULL, &now) == -1 && errno == EINTR)
+            ;
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/* Start sh -c cmd with a pipe to its stdin, or from its stdout, and
+ * return our end; -1 if that fails. A command read from in batch mode
+ * gets /dev/null for stdin, the script is ours. */
+static int spawn_shell(const char* cmd, bool to_child, pid_t* pid)
+{
+    extern char** environ;
+    char* argv[] = { "sh", "-c", (char*)cmd, NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none, pipe_sig;
+    int fds[2];
+
+    if (pipe(fds) == -1)
+        return -1;
+
+    int ours = to_child ? fds[1] : fds[0];
+    int theirs = to_child ? fds[0] : fds[1];
+
+    fcntl(ours, F_SETFD, FD_CLOEXEC);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, theirs, to_child ? STDIN_FILENO : STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, theirs);
+    if (!to_child && !interactive)
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+    // the shell starts with SIGPIPE as it should be, whatever ours is
+    sigemptyset(&none);
+    sigemptyset(&pipe_sig);
+    sigaddset(&pipe_sig, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &pipe_sig);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    fflush(out);
+    int err = posix_spawn(pid, "/bin/sh", &actions, &attr, argv, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(theirs);
+
+    if (err != 0) {
+        close(ours);
+        errno = err;
+        return -1;
+    }
+
+    return ours;
+}
+
+static void wait_shell(pid_t pid)
+{
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+        ;
+}
+
+/* Take the output of a command, e !cmd or r !cmd, after line num as it
+ * arrives. It is read in blocks and spliced in every STREAM_SPLICE lines,
+ * with a check of --mem-limit after each, so memory stays bounded by
+ * the buffer, however long the stream. */
+static void read_shell(int num, const char* cmd, bool replace)
+{
+    reader rd = { .fd = -1 };
+    size_t total = 0;
+    list* lst = NULL;
+    char* line;
+    size_t len;
+    pid_t pid;
+
+    rd.fd = spawn_shell(cmd, false, &pid);
+    if (rd.fd == -1) {
+        fprintf(out, "%s: %s\n", cmd, strerror(errno));
+        error(SHELL);
+        return;
+    }
+
+    if (replace) {
+        load_cancel();
+        journal_clear();
+        clear_buffer();
+        num = 0;
+    }
+
+    while ((line = reader_line(&rd, &len)) != NULL) {
+        if (lst == NULL) {
+            lst = malloc(sizeof(list));
+            init_list(lst);
+        }
+
+        append_node(lst, new_node(line, len));
+        total += len + !rd.partial;
+
+        if (lst->length == STREAM_SPLICE) {
+            num += insert_into_buffer(lst, num);
+            lst = NULL;
+            check_limit();
+        }
+    }
+
+    if (lst != NULL) {
+        bool at_end = num == buffer.length;
+
+        num += insert_into_buffer(lst, num);
+        if (at_end && rd.partial)
+            buffer.no_eol = true;
+    }
+
+    close(rd.fd);
+    free(rd.buf);
+    wait_shell(pid);
+
+    current_line = num;
+    if (replace)
+        buffer.modified = false;
+    asked = false;
+    fprintf(out, "%zu\n", total);
+}
+
+/* w !cmd: lines start to end go to the command's stdin, its output is
+ * left to go straight to ours */
+static void write_shell(int start, int end, const char* cmd)
+{
+    size_t total = 0;
+    pid_t pid;
+    int fd = spawn_shell(cmd, true, &pid);
+
+    if (fd == -1) {
+        fprintf(out, "%s: %s\n", cmd, strerror(errno));
+        error(SHELL);
+        return;
+    }
+
+    // a command that stops reading early is not an error
+    sigset_t mask;
+
+    pipe_hold(&mask);
+    bool ok = write_lines(fd, node_at(start), end > 0 ? node_at(end)->next : NULL, &total) ||
+              errno == EPIPE;
+
+    pipe_release(&mask);
+    close(fd);
+    wait_shell(pid);
+
+    if (!ok) {
+        error(SHELL);
+        return;
+    }
+
+    fprintf(out, "%zu\n", total);
+}
+
+/* Add what was written to the followed file past follow_off to the end of
+ * the buffer. A last line that had no newline is continued by the first
+ * new one. */
+static void follow_append(int fd)
+{
+    reader rd = { .fd = fd };
+    bool modified = buffer.modified;
+    list* lst = NULL;
+    char* line;
+    size_t len;
+
+    while ((line = reader_line(&rd, &len)) != NULL) {
+        follow_off += len + !rd.partial;
+
+        if (lst == NULL && buffer.no_eol && buffer.last != NULL) {
+            node* last = buffer.last;
+            char* text = malloc(last->len + len);
+            list one;
+
+            memcpy(text, line_text(last), last->len);
+            memcpy(text + last->len, line, len);
+            init_list(&one);
+            append_node(&one, new_node(text, last->len + len));
+
+            // journaled as a c of the last line would be
+            journal_delete(buffer.length, buffer.length);
+            journal_insert(buffer.length - 1, &one);
+            replace_node(last, one.first);
+            buffer.no_eol = false;
+            free(text);
+            continue;
+        }
+
+        if (lst == NULL) {
+            lst = malloc(sizeof(list));
+            init_list(lst);
+        }
+
+        append_node(lst, new_node(line, len));
+
+        if (lst->length == STREAM_SPLICE) {
+            insert_into_buffer(lst, buffer.length);
+            lst = NULL;
+            check_limit();
+        }
+    }
+
+    if (lst != NULL)
+        insert_into_buffer(lst, buffer.length);
+
+    if (rd.partial)
+        buffer.no_eol = true;
+    buffer.modified = modified;
+    free(rd.buf);
+
+    // not from a command, so nothing else writes the records out
+    journal_flush();
+}
+
+/* Bring the buffer up to date with the followed file: new bytes are
+ * appended, a file that shrank or was replaced is read again. */
+static void follow_check()
+{
+    struct stat st;
+
+    if (stat(follow_path, &st) == -1)
+        return;
+
+    if (st.st_dev != follow_dev || st.st_ino != follow_ino || st.st_size < follow_off) {
+        read_file(follow_path);
+        return;
+    }
+
+    if (st.st_size == follow_off)
+        return;
+
+    int fd = open(follow_path, O_RDONLY);
+
+    if (fd == -1)
+        return;
+
+    if (lseek(fd, follow_off, SEEK_SET) != -1)
+        follow_append(fd);
+    close(fd);
+}
+
+/* the followed file was written from the buffer, take it as read */
+static void follow_sync()
+{
+    struct stat st;
+
+    if (stat(follow_path, &st) == 0) {
+        follow_dev = st.st_dev;
+        follow_ino = st.st_ino;
+        follow_off = st.st_size;
+    }
+}
+
+/* check the followed file if anything happened to its name; without
+ * inotify, check every time */
+static void follow_poll()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool hit = follow_fd == -1;
+    ssize_t r;
+
+    while (follow_fd != -1 && ((r = read(follow_fd, buf, sizeof(buf))) > 0 || (r == -1 && errno == EINTR))) {
+        for (char* p = buf; p < buf + r; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+
+            if ((ev->mask & IN_Q_OVERFLOW) ||
+                (ev->len > 0 && strcmp(ev->name, follow_name) == 0))
+                hit = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if (hit)
+        follow_check();
+}
+
+/* append the complete lines in p[0..n) to lst, stopping after a "."
+ * line. Returns the number of bytes used; *done is set when "." was seen. */
+static size_t scan_text(const char* p, size_t n, list* lst, bool* done)
+{
+    const char* start = p;
+    const char* stop = p + n;
+    const char* nl;
+
+    *done = false;
+
+    while ((nl = memchr(p, '\n', stop - p)) != NULL) {
+        size_t len = nl - p;
+
+        if (len == 1 && p[0] == '.') {
+            *done = true;
+            return nl + 1 - start;
+        }
+
+        append_node(lst, new_node(p, len));
+        p = nl + 1;
+    }
+
+    return p - start;
+}
+
+/* Bulk ingestion for piped input: scan whole blocks for line breaks and
+ * link the lines up until the terminating "." without any per line
+ * round trips through linenoise. */
+static list* bulk_input()
+{
+    list* input_buffer = malloc(sizeof(list));
+    init_list(input_buffer);
+
+    while (reader_fill(&input)) {
+        bool done;
+
+        input.start += scan_text(input.buf + input.start,
+                                 input.end - input.start, input_buffer, &done);
+        if (done)
+            break;
+
+        // unterminated last line of the input
+        if (input.eof && input.start < input.end) {
+            size_t len = 0;
+            char* line = reader_line(&input, &len);
+
+            if (len == 1 && line[0] == '.')
+                break;
+
+            append_node(input_buffer, new_node(line, len));
+        }
+    }
+
+    if (input_buffer->length == 0) {
+        free(input_buffer);
+        return NULL;
+    }
+
+    return input_buffer;
+}
+
+static void schedule(enum idle_t work)
+{
+    idle_work |= work;
+
+    // two passes: one to age the lines, one to pack the cold ones
+    if (work & IDLE_PACK)
+        pack_left = 2 * (long)buffer.length;
+}
+
+/* does moving the text out of the node make it smaller */
+static bool packable(node* nd)
+{
+    return nd->kind == T_INLINE &&
+           alloc_size(node_size(T_PACKED, 0)) < alloc_size(node_size(T_INLINE, nd->len));
+}
+
+/* compress the texts of the inline lines among n nodes from first into
+ * one block; lines too short to gain from it are left alone */
+static void pack_run(node* first, int n)
+{
+    size_t raw = 0;
+    int count = 0;
+    node* cur = first;
+
+    for (int i = 0; i < n; i++, cur = cur->next) {
+        if (packable(cur)) {
+            raw += cur->len;
+            count++;
+        }
+    }
+
+    if (count == 0)
+        return;
+
+    char* text = malloc(raw);
+    char* out = malloc(raw);
+    size_t at = 0;
+
+    cur = first;
+    for (int i = 0; i < n; i++, cur = cur->next) {
+        if (packable(cur)) {
+            memcpy(text + at, cur->text.buf, cur->len);
+            at += cur->len;
+        }
+    }
+
+    // not worth it unless it saves an eighth
+    size_t size = lz_compress(text, raw, out, raw - raw / 8);
+    free(text);
+
+    if (size == 0) {
+        free(out);
+        return;
+    }
+
+    pack* pk = malloc(sizeof(pack) + size);
+    pk->refs = count;
+    pk->raw = raw;
+    pk->size = size;
+    memcpy(pk->data, out, size);
+    free(out);
+
+    mem.packs++;
+    mem.packed_raw += raw;
+    mem.bytes += alloc_size(sizeof(pack) + size);
+    schedule(IDLE_TRIM);
+
+    at = 0;
+    cur = first;
+    for (int i = 0; i < n; i++) {
+        node* next = cur->next;
+
+        if (packable(cur)) {
+            mem.bytes -= alloc_size(node_size(T_INLINE, cur->len));
+            mem.bytes += alloc_size(node_size(T_PACKED, 0));
+            mem.lines[T_INLINE]--;
+            mem.lines[T_PACKED]++;
+
+            cur->kind = T_PACKED;
+            cur->text.packed.pack = pk;
+            cur->text.packed.offset = at;
+            at += cur->len;
+
+            resize_node(cur, node_size(T_PACKED, 0));
+        }
+
+        cur = next;
+    }
+}
+
+/* compress runs of lines nobody read since the last pass, while line
+ * storage is over the -z budget */
+static bool pack_cold()
+{
+    for (int step = 0; step < PACK_STEP; step++) {
+        // like spilling, packing waits for a pending save
+        if (!packing || mem.bytes <= pack_budget || pack_left <= 0 || save_cur != NULL)
+            return false;
+
+        if (pack_cursor == NULL)
+            pack_cursor = buffer.first;
+        if (pack_cursor == NULL)
+            return false;
+
+        node* first = pack_cursor;
+        node* cur = first;
+        bool hot = false;
+        int n = 0;
+
+        for (; cur != NULL && n < PACK_LINES; cur = cur->next, n++) {
+            hot |= cur->touched;
+            cur->touched = 0;
+        }
+
+        pack_cursor = cur;
+        pack_left -= n;
+
+        if (!hot)
+            pack_run(first, n);
+    }
+
+    return true;
+}
+
+/* hand freed memory back to the system after large deletes */
+static bool trim_heap()
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    return false;
+}
+
+/* make what the journal has been given durable, once the typing stops */
+static bool sync_journal()
+{
+    if (journal_fd != -1)
+        fdatasync(journal_fd);
+    return false;
+}
+
+static idle_task idle_tasks[] = {
+    trim_heap,
+    pack_cold,
+    sync_journal
+};
+
+/* run one step of the first pending idle task */
+static void run_idle()
+{
+    for (unsigned i = 0; i < sizeof(idle_tasks) / sizeof(idle_tasks[0]); i++) {
+        if (idle_work & (1u << i)) {
+            if (!idle_tasks[i]())
+                idle_work &= ~(1u << i);
+            return;
+        }
+    }
+}
+
+/* Stop journaling; the journal goes too, its edits were saved or given up. */
+static void journal_detach()
+{
+    if (journal_fd != -1) {
+        close(journal_fd);
+        unlink(journal_path);
+    }
+
+    free(journal_path);
+    journal_path = NULL;
+    journal_fd = -1;
+    journal_len = 0;
+    journal_end = 0;
+    journaling = false;
+    journal_gen++;
+}
+
+/* what a journal for the file at path starts with */
+static void journal_identify(const char* path, journal_head* h)
+{
+    struct stat st;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "emj1\n", 5);
+    if (stat(path, &st) == 0) {
+        h->size = st.st_size;
+        h->mtime_sec = st.st_mtim.tv_sec;
+        h->mtime_nsec = st.st_mtim.tv_nsec;
+        h->ino = st.st_ino;
+    }
+}
+
+/* Lines as they were at mark in the journal were saved to path: the
+ * journal is now for that file, with only the records after mark. */
+static void journal_saved(const char* path, unsigned gen, off_t mark)
+{
+    if (!journaling || gen != journal_gen)
+        return;
+
+    journal_flush();
+
+    char* jpath = sidecar_path(path, "emj");
+    size_t tail = journal_fd != -1 && journal_end > mark ? journal_end - mark : 0;
+    char* rest = malloc(tail + 1);
+    int fd = -1;
+
+    ssize_t r;
+
+    while (tail > 0 && (r = pread(journal_fd, rest, tail, mark)) == -1 && errno == EINTR)
+        ;
+    if (tail > 0 && r != (ssize_t)tail)
+        tail = 0;
+
+    journal_identify(path, &journal_id);
+
+    if (tail > 0) {
+        char* tmp = malloc(strlen(jpath) + sizeof(".XXXXXX"));
+
+        sprintf(tmp, "%s.XXXXXX", jpath);
+        if ((fd = mkstemp(tmp)) != -1 &&
+            (write_all(fd, &journal_id, sizeof(journal_id)) != sizeof(journal_id) ||
+             write_all(fd, rest, tail) != tail || rename(tmp, jpath) == -1)) {
+            close(fd);
+            unlink(tmp);
+            fd = -1;
+        }
+        free(tmp);
+    }
+
+    if (journal_fd != -1)
+        close(journal_fd);
+    if (strcmp(jpath, journal_path) != 0 || fd == -1)
+        unlink(journal_path);
+
+    free(rest);
+    free(journal_path);
+    journal_path = jpath;
+    journal_fd = fd;
+    journal_end = fd != -1 ? (off_t)(sizeof(journal_id) + tail) : 0;
+    if (fd != -1)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void add_piece(save* sv, const char* text, size_t len, bool nl)
+{
+    if (sv->count == sv->cap) {
+        sv->cap = sv->cap == 0 ? 1024 : sv->cap * 2;
+        sv->pieces = realloc(sv->pieces, sv->cap * sizeof(piece));
+    }
+
+    sv->pieces[sv->count++] = (piece){ text, len, nl };
+}
+
+/* Take a snapshot of lines start to end for a save. Chunks of long lines
+ * go in one by one, text out of a cache is copied into blocks, and the
+ * mappings are held so that nothing the save reads goes away. */
+static save* snapshot(int start, int end)
+{
+    save* sv = calloc(1, sizeof(save));
+    node* stop = end > 0 ? node_at(end)->next : NULL;
+    size_t used = 0;
+    size_t room = 0;
+
+    for (node* cur = node_at(start); cur != stop; cur = cur->next) {
+        bool nl = cur->next != NULL || !buffer.no_eol;
+
+        if (cur->kind == T_CHUNKED) {
+            rope* rp = cur->text.rope;
+
+            for (int i = 0; i < rp->count; i++)
+                add_piece(sv, rp->chunks[i]->data, rp->chunks[i]->len, nl && i == rp->count - 1);
+            continue;
+        }
+
+        if (cur->kind != T_PACKED && cur->kind != T_SPILLED) {
+            add_piece(sv, line_text(cur), cur->len, nl);
+            continue;
+        }
+
+        if (cur->len > room - used) {
+            room = cur->len > SAVE_BLOCK ? cur->len : SAVE_BLOCK;
+            used = 0;
+            sv->blocks = realloc(sv->blocks, (sv->nblocks + 1) * sizeof(char*));
+            sv->blocks[sv->nblocks++] = malloc(room);
+        }
+
+        char* copy = sv->blocks[sv->nblocks - 1] + used;
+
+        memcpy(copy, line_text(cur), cur->len);
+        used += cur->len;
+        add_piece(sv, copy, cur->len, nl);
+    }
+
+    for (map* mp = maps; mp != NULL; mp = mp->next) {
+        sv->held = realloc(sv->held, (sv->nheld + 1) * sizeof(map*));
+        sv->held[sv->nheld++] = mp;
+        mp->refs++;
+    }
+
+    return sv;
+}
+
+static void free_snapshot(save* sv)
+{
+    for (int i = 0; i < sv->nblocks; i++)
+        free(sv->blocks[i]);
+    for (int i = 0; i < sv->nheld; i++)
+        release_map(sv->held[i]);
+
+    free(sv->pieces);
+    free(sv->blocks);
+    free(sv->held);
+    free(sv->filename);
+    free(sv->tmp);
+    free(sv);
+}
+
+/* The save thread: write the snapshot to its temporary file, sync it and
+ * rename it over the target, then hand it back through save_pipe. */
+static void* save_run(void* arg)
+{
+    save* sv = arg;
+    struct iovec iov[WRITE_BATCH * 2];
+
+    for (size_t i = 0; i < sv->count && sv->err == 0; ) {
+        int n = 0;
+
+        for (; i < sv->count && n < WRITE_BATCH * 2 - 1; i++) {
+            iov[n].iov_base = (char*)sv->pieces[i].text;
+            iov[n++].iov_len = sv->pieces[i].len;
+            if (sv->pieces[i].nl) {
+                iov[n].iov_base = "\n";
+                iov[n++].iov_len = 1;
+            }
+        }
+
+        if (!write_iov(sv->fd, iov, n, &sv->total))
+            sv->err = errno;
+    }
+
+    if (sv->err == 0 && fsync(sv->fd) == -1)
+        sv->err = errno;
+    if (close(sv->fd) == -1 && sv->err == 0)
+        sv->err = errno;
+    if (sv->err == 0 && rename(sv->tmp, sv->filename) == -1)
+        sv->err = errno;
+    if (sv->err != 0)
+        unlink(sv->tmp);
+
+    while (write(save_pipe[1], &sv, sizeof(sv)) == -1 && errno == EINTR)
+        ;
+    return NULL;
+}
+
+/* start the save thread on sv, or do the save here if there is none */
+static void save_start(save* sv)
+{
+    save_cur = sv;
+    save_threaded = pthread_create(&save_thread, NULL, save_run, sv) == 0;
+    if (!save_threaded)
+        save_run(sv);
+}
+
+/* Report the saves that are done, at most one when wait is set, which
+ * blocks for it; the next one queued is started. When none is left, the
+ * frees held for them are done. */
+static void save_take(bool wait)
+{
+    save* sv;
+
+    while (save_cur != NULL) {
+        if (wait) {
+            struct pollfd pfd = { save_pipe[0], POLLIN, 0 };
+
+            poll(&pfd, 1, -1);
+        }
+
+        ssize_t r = read(save_pipe[0], &sv, sizeof(sv));
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r != sizeof(sv))
+            return;
+
+        if (save_threaded)
+            pthread_join(save_thread, NULL);
+
+        if (sv->err != 0) {
+            fprintf(out, "%s: %s\n", sv->filename, strerror(sv->err));
+            error(IFILE);
+            if (sv->whole)
+                buffer.modified = true;
+        } else {
+            fprintf(out, "%zu\n", sv->total);
+            if (following && strcmp(sv->filename, follow_path) == 0)
+                follow_sync();
+            if (sv->whole)
+                journal_saved(sv->filename, sv->journal_gen, sv->journal_mark);
+        }
+
+        free_snapshot(sv);
+        save_cur = NULL;
+
+        if (save_next != NULL) {
+            sv = save_next;
+            save_next = NULL;
+            save_start(sv);
+        }
+
+        if (wait)
+            break;
+    }
+
+    if (save_cur != NULL)
+        return;
+
+    for (size_t i = 0; i < deferred_count; i++)
+        free(deferred[i]);
+    deferred_count = 0;
+
+    if (packing)
+        schedule(IDLE_PACK);
+    check_limit();
+}
+
+/* wait for the saves to filename, or all of them when it is NULL */
+static void save_wait(const char* filename)
+{
+    while (save_cur != NULL &&
+           (filename == NULL || strcmp(save_cur->filename, filename) == 0 ||
+            (save_next != NULL && strcmp(save_next->filename, filename) == 0)))
+        save_take(true);
+}
+
+/* w at the prompt: lines start to end are saved in the background, with
+ * a temporary file synced and renamed over filename. The size is printed
+ * when it is done. A w while one is pending replaces the one queued
+ * after it, or is dropped if the buffer is as it was saved. */
+static void save_buffer(char* filename, int start, int end)
+{
+    bool whole = start <= 1 && end == buffer.length;
+    struct stat st;
+
+    if (filename == NULL) {
+        error(NO_FILE);
+        return;
+    }
+
+    if (save_cur != NULL && whole && !buffer.modified && save_cur->whole && save_next == NULL &&
+        strcmp(save_cur->filename, filename) == 0)
+        return;
+
+    // one queued save at a time, a w to another file waits its turn
+    if (save_next != NULL && strcmp(save_next->filename, filename) != 0)
+        save_wait(save_next->filename);
+
+    char* tmp = malloc(strlen(filename) + sizeof(".XXXXXX"));
+    sprintf(tmp, "%s.XXXXXX", filename);
+
+    int fd = mkstemp(tmp);
+
+    if (fd == -1) {
+        fprintf(out, "%s: No such file or directory\n", filename);
+        free(tmp);
+        error(IFILE);
+        return;
+    }
+
+    if (stat(filename, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    if (save_pipe[0] == -1 && pipe(save_pipe) == 0) {
+        fcntl(save_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(save_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(save_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    save* sv = snapshot(start, end);
+
+    sv->filename = strdup(filename);
+    sv->tmp = tmp;
+    sv->fd = fd;
+    sv->whole = whole;
+    sv->journal_gen = journal_gen;
+    // the header is written with the first record
+    sv->journal_mark = (journal_fd != -1 ? journal_end : (off_t)sizeof(journal_id)) + journal_len;
+    if (whole)
+        buffer.modified = false;
+
+    if (save_cur == NULL) {
+        save_start(sv);
+        return;
+    }
+
+    if (save_next != NULL) {
+        unlink(save_next->tmp);
+        close(save_next->fd);
+        free_snapshot(save_next);
+    }
+    save_next = sv;
+}
+
+/* edit a line at the prompt, running idle tasks while no keys come,
+ * taking in what is added to a followed file or loaded in the background
+ * and reporting saves that are done */
+static char* edit_line(const char* prompt)
+{
+    struct linenoiseState ls;
+    char* line;
+    bool idle = false;
+
+    if ((line = linenoisePastedLine()) != NULL)
+        return line;
+
+    if (linenoiseEditStart(&ls, -1, -1, NULL, LINE_MAX_EDIT, prompt) == -1)
+        return NULL;
+
+    do {
+        struct pollfd pfd[4] = {
+            { ls.ifd, POLLIN, 0 },
+            { following ? follow_fd : -1, POLLIN, 0 },
+            { loading ? load_pipe[0] : -1, POLLIN, 0 },
+            { save_cur != NULL ? save_pipe[0] : -1, POLLIN, 0 }
+        };
+        // keys read after a paste are not on the fd any more
+        bool pending = linenoiseEditPending(&ls);
+        int wait = pending ? 0 : idle_work == 0 ? -1 : idle ? 0 : IDLE_DELAY;
+        int r = poll(pfd, 4, wait);
+
+        if (r == 0 && !pending) {
+            run_idle();
+            idle = true;
+            line = linenoiseEditMore;
+            continue;
+        }
+
+        if (r == -1 && errno != EINTR) {
+            line = NULL;
+            break;
+        }
+
+        // a resize interrupts the wait, redraw for the new width now
+        if (r == -1)
+            linenoiseEditResized(&ls);
+
+        if (r > 0 && (pfd[1].revents & POLLIN)) {
+            // a reload prints its size, keep it off the line being edited
+            linenoiseEditHide(&ls);
+            follow_poll();
+            linenoiseEditShow(&ls);
+        }
+
+        if (r > 0 && (pfd[2].revents & (POLLIN | POLLHUP)))
+            load_take(true);
+
+        if (r > 0 && (pfd[3].revents & POLLIN)) {
+            linenoiseEditHide(&ls);
+            save_take(false);
+            linenoiseEditShow(&ls);
+        }
+
+        idle = false;
+        line = pending || (r > 0 && (pfd[0].revents & POLLIN)) ? linenoiseEditFeed(&ls) : linenoiseEditMore;
+    } while (line == linenoiseEditMore);
+
+    linenoiseEditStop(&ls);
+    return line;
+}
+
+/* Apply the records of a journal, up to end, to the buffer; returns how
+ * many there were. It stops at one that does not fit the buffer. */
+static int journal_replay(const unsigned char* p, const unsigned char* end)
+{
+    int count = 0;
+
+    while (p < end) {
+        uint64_t len;
+
+        memcpy(&len, p, 8);
+        const unsigned char* q = p + JOURNAL_RECORD + 1;
+        const unsigned char* stop = p + JOURNAL_RECORD + len;
+        char op = p[JOURNAL_RECORD];
+        uint64_t a, b, n;
+        bool ok = true;
+
+        p = stop;
+
+        if (op == 'd') {
+            ok = index_next(&q, stop, &a) && index_next(&q, stop, &b) &&
+                 a >= 1 && a <= b && b <= (uint64_t)buffer.length;
+            if (ok)
+                delete_range(a, b);
+        } else if (op == 'i') {
+            list* lst = malloc(sizeof(list));
+
+            init_list(lst);
+            ok = index_next(&q, stop, &a) && a <= (uint64_t)buffer.length;
+            while (ok && q < stop && (ok = index_next(&q, stop, &n) && n <= (uint64_t)(stop - q))) {
+                append_node(lst, new_node((const char*)q, n));
+                q += n;
+            }
+
+            if (ok && lst->length > 0)
+                insert_into_buffer(lst, a);
+            else
+                drop_text(lst);
+        } else if (op == 's') {
+            size_t found = 0;
+            uint64_t last = 0;
+            node* nd = NULL;
+
+            subst_len = 0;
+            ok = index_next(&q, stop, &a) && a >= 1 && a <= (uint64_t)buffer.length;
+            if (ok)
+                nd = node_at(a);
+
+            while (ok && q < stop) {
+                ok = index_next(&q, stop, &a) && index_next(&q, stop, &b) &&
+                     index_next(&q, stop, &n) && last <= a && a <= b && b <= nd->len &&
+                     n <= (uint64_t)(stop - q);
+                if (ok) {
+                    add_edit(found++, a, b, "", NULL, NULL);
+                    subst_put((const char*)q, n);
+                    q += n;
+                    last = b;
+                }
+            }
+
+            if (ok && found > 0)
+                subst_line(nd, NULL, found);
+        } else if (op == 'z') {
+            clear_buffer();
+        } else if (op == 'n') {
+            ok = q < stop && *q <= 1;
+            if (ok)
+                buffer.no_eol = *q;
+        } else {
+            ok = false;
+        }
+
+        if (!ok)
+            break;
+        count++;
+    }
+
+    return count;
+}
+
+/* Look through a journal for its good records: the ones before the
+ * first torn or damaged one. Returns their end, *count is how many. */
+static off_t journal_scan(const unsigned char* base, size_t size, int* count)
+{
+    size_t off = sizeof(journal_head);
+
+    *count = 0;
+    while (size - off >= JOURNAL_RECORD + 1) {
+        uint64_t len;
+        uint32_t crc;
+
+        memcpy(&len, base + off, 8);
+        memcpy(&crc, base + off + 8, 4);
+        if (len == 0 || len > size - off - JOURNAL_RECORD ||
+            crc32c(0, base + off + JOURNAL_RECORD, len) != crc)
+            break;
+
+        off += JOURNAL_RECORD + len;
+        (*count)++;
+    }
+
+    return off;
+}
+
+/* Journal the edits to the buffer read from path, which is how a session
+ * that did not end cleanly leaves them. If it left one for this version
+ * of the file, offer to replay it over the buffer. */
+static void journal_attach(const char* path)
+{
+    journal_detach();
+    journaling = true;
+    journal_path = sidecar_path(path, "emj");
+    journal_identify(path, &journal_id);
+    journal_no_eol = buffer.no_eol;
+
+    int fd = open(journal_path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+
+    if (fd == -1)
+        return;
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(journal_head)) {
+        close(fd);
+        unlink(journal_path);
+        return;
+    }
+
+    unsigned char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int count = 0;
+    off_t end = 0;
+    char* answer = NULL;
+
+    if (base != MAP_FAILED && memcmp(base, &journal_id, sizeof(journal_head)) == 0)
+        end = journal_scan(base, st.st_size, &count);
+    else if (base != MAP_FAILED)
+        fprintf(out, "%s: journal is for another version of %s, removed\n", journal_path, path);
+
+    if (count > 0) {
+        char* prompt = malloc(strlen(path) + 64);
+
+        sprintf(prompt, "recover %d unsaved changes to %s (y/n)? ", count, path);
+        answer = edit_line(prompt);
+        free(prompt);
+    }
+
+    if (answer != NULL && (answer[0] == 'y' || answer[0] == 'Y')) {
+        // replayed edits are in the journal already
+        journaling = false;
+        load_wait(INT_MAX);
+        count = journal_replay(base + sizeof(journal_head), base + end);
+        journaling = true;
+
+        ftruncate(fd, end);
+        lseek(fd, end, SEEK_SET);
+        journal_fd = fd;
+        journal_end = end;
+        journal_no_eol = buffer.no_eol;
+        buffer.modified = true;
+        current_line = buffer.length;
+        fprintf(out, "%d\n", count);
+    } else {
+        // kept if there was no answer, the next edit replaces it anyway
+        close(fd);
+        if (answer != NULL || count == 0)
+            unlink(journal_path);
+    }
+
+    free(answer);
+    if (base != MAP_FAILED)
+        munmap(base, st.st_size);
+}
+
+static list* text_input()
+{
+    if (!interactive)
+        return bulk_input();
+
+    list* input_buffer = malloc(sizeof(list));
+    init_list(input_buffer);
+
+    char* line;
+
+    while ((line = edit_line("")) != NULL) {
+        if (strcmp(".", line) == 0) {
+            free(line);
+            break;
+        }
+
+        append_node(input_buffer, new_node(line, strlen(line)));
+        free(line);
+
+        // take the rest of a pasted block in one go
+        const char* pasted;
+        size_t len;
+        bool done = false;
+
+        if ((pasted = linenoisePasted(&len)) != NULL) {
+            size_t used = scan_text(pasted, len, input_buffer, &done);
+            linenoisePastedConsume(used);
+        }
+        if (done)
+            break;
+    }
+
+    if (input_buffer->length == 0) {
+        free(input_buffer);
+        return NULL;
+    }
+
+    return input_buffer;
+}
+
+/* command history is kept in $EM_HISTORY or ~/.em_history */
+static void init_history()
+{
+    const char* path = getenv("EM_HISTORY");
+    const char* home = getenv("HOME");
+
+    if (path != NULL) {
+        history_path = strdup(path);
+    } else if (home != NULL) {
+        history_path = malloc(strlen(home) + sizeof("/.em_history"));
+        sprintf(history_path, "%s/.em_history", home);
+    } else {
+        return;
+    }
+
+    linenoiseHistorySetMaxLen(HISTORY_MAX);
+    linenoiseHistoryLoad(history_path);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void free_dir(dir_cache* dc)
+{
+    for (int i = 0; i < dc->count; i++)
+        free(dc->names[i]);
+    free(dc->names);
+    free(dc->path);
+    dc->names = NULL;
+    dc->path = NULL;
+    dc->count = 0;
+}
+
+/* read a directory into dc, directories get a trailing '/' */
+static bool scan_dir(dir_cache* dc, const char* path, struct timespec mtime)
+{
+    DIR* dir = opendir(path);
+    struct dirent* ent;
+    int cap = 64;
+
+    if (dir == NULL)
+        return false;
+
+    free_dir(dc);
+    dc->path = strdup(path);
+    dc->mtime = mtime;
+    dc->names = malloc(cap * sizeof(char*));
+
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        bool is_dir = ent->d_type == DT_DIR;
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        if (dc->count == cap) {
+            cap *= 2;
+            dc->names = realloc(dc->names, cap * sizeof(char*));
+        }
+
+        char* name = malloc(len + 2);
+        memcpy(name, ent->d_name, len);
+        if (is_dir)
+            name[len++] = '/';
+        name[len] = 0;
+        dc->names[dc->count++] = name;
+    }
+
+    closedir(dir);
+    qsort(dc->names, dc->count, sizeof(char*), compare_names);
+    return true;
+}
+
+/* the cached listing of path, read again only when its mtime changed */
+static dir_cache* lookup_dir(const char* path)
+{
+    struct stat st;
+    dir_cache* slot = &dirs[0];
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        dir_cache* dc = &dirs[i];
+
+        if (dc->path != NULL && strcmp(dc->path, path) == 0) {
+            slot = dc;
+            if (dc->mtime.tv_sec == st.st_mtim.tv_sec &&
+                dc->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                dc->used = ++dir_clock;
+                return dc;
+            }
+            break;
+        }
+
+        // otherwise replace the least recently used entry
+        if (dc->used < slot->used)
+            slot = dc;
+    }
+
+    if (!scan_dir(slot, path, st.st_mtim))
+        return NULL;
+
+    slot->used = ++dir_clock;
+    return slot;
+}
+
+/* complete the file name that starts at arg, the rest of buf is kept */
+static void complete_filename(const char* buf, const char* arg, linenoiseCompletions* lc)
+{
+    const char* slash = strrchr(arg, '/');
+    const char* base = slash != NULL ? slash + 1 : arg;
+    size_t base_len = strlen(base);
+    size_t head_len = base - buf;
+    char* dir;
+
+    if (slash == NULL)
+        dir = strdup(".");
+    else if (slash == arg)
+        dir = strdup("/");
+    else
+        dir = strndup(arg, slash - arg);
+
+    dir_cache* dc = lookup_dir(dir);
+    free(dir);
+
+    if (dc == NULL)
+        return;
+
+    // first name not below the prefix
+    int lo = 0, hi = dc->count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (strcmp(dc->names[mid], base) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    char* line = NULL;
+    size_t cap = 0;
+
+    for (int i = lo, n = 0; i < dc->count && n < COMPLETE_MAX; i++) {
+        const char* name = dc->names[i];
+        size_t len = strlen(name);
+
+        if (strncmp(name, base, base_len) != 0)
+            break;
+
+        // hidden files only when asked for
+        if (name[0] == '.' && base[0] != '.')
+            continue;
+
+        if (head_len + len + 1 > cap) {
+            cap = head_len + len + 1;
+            line = realloc(line, cap);
+        }
+        memcpy(line, buf, head_len);
+        memcpy(line + head_len, name, len + 1);
+        linenoiseAddCompletion(lc, line);
+        n++;
+    }
+
+    free(line);
+}
+
+/* tab completion: command letters after an address, file names after e, w, r and b */
+static void complete(const char* buf, linenoiseCompletions* lc)
+{
+    const char* p = buf + strspn(buf, "0123456789.$+-,; \t");
+
+    if (*p == 0) {
+        size_t len = strlen(buf);
+        char* line = malloc(len + 2);
+
+        memcpy(line, buf, len);
+        line[len + 1] = 0;
+        for (const char* c = commands; *c; c++) {
+            line[len] = *c;
+            linenoiseAddCompletion(lc, line);
+        }
+        free(line);
+        return;
+    }
+
+    if (strchr("ewrb", *p) != NULL && *p != 0 && (p[1] == ' ' || p[1] == '\t'))
+        complete_filename(buf, skip_blanks(p + 1), lc);
+}
+
+/* read the next command line, through linenoise when on a terminal */
+static char* read_command()
+{
+    if (interactive) {
+        char* line = edit_line("");
+
+        if (line != NULL && line[0] != 0 && history_path != NULL) {
+            linenoiseHistoryAdd(line);
+            linenoiseHistorySave(history_path);
+        }
+
+        return line;
+    }
+
+    size_t len;
+    char* line = reader_line(&input, &len);
+
+    return line != NULL ? strdup(line) : NULL;
+}
+
+static void set_filename(const char* name)
+{
+    free(filename);
+    filename = strdup(name);
+}
+
+/* add an empty buffer, in a slot closed earlier if there is one;
+ * returns its slot */
+static int add_buffer()
+{
+    int n = 0;
+
+    while (n < buffer_count && !buffers[n].closed)
+        n++;
+
+    if (n == buffer_count) {
+        buffers = realloc(buffers, (buffer_count + 1) * sizeof(buf_state));
+        buffer_count++;
+    }
+
+    buf_state* b = &buffers[n];
+
+    memset(b, 0, sizeof(*b));
+    init_list(&b->lines);
+    b->journal_fd = -1;
+    return n;
+}
+
+/* Make the buffer in slot n the one being edited, putting this one
+ * aside. Nothing is waited for, and the journal must have been flushed:
+ * m and t swap to the buffer they put lines in and back. */
+static void swap_buffer(int n)
+{
+    buf_state* b = &buffers[current_buffer];
+
+    b->lines = buffer;
+    b->current_line = current_line;
+    b->filename = filename;
+    b->following = following;
+    b->journaling = journaling;
+    b->journal_fd = journal_fd;
+    b->journal_path = journal_path;
+    b->journal_id = journal_id;
+    b->journal_end = journal_end;
+    b->journal_no_eol = journal_no_eol;
+
+    b = &buffers[n];
+    buffer = b->lines;
+    current_line = b->current_line;
+    filename = b->filename;
+    following = b->following;
+    journaling = b->journaling;
+    journal_fd = b->journal_fd;
+    journal_path = b->journal_path;
+    journal_id = b->journal_id;
+    journal_end = b->journal_end;
+    journal_no_eol = b->journal_no_eol;
+    current_buffer = n;
+}
+
+/* Switch to the buffer in slot n. A background load or save of the one
+ * left is seen through first, they work on the buffer being edited. */
+static void switch_buffer(int n)
+{
+    if (n == current_buffer)
+        return;
+
+    load_wait(INT_MAX);
+    save_wait(NULL);
+    journal_flush();
+    swap_buffer(n);
+
+    // the sweeps start over on these lines
+    pack_cursor = NULL;
+    spill_cursor = NULL;
+    spill_floor = 0;
+
+    // what was added to the followed file while it was away
+    if (following)
+        follow_check();
+}
+
+/* is any buffer modified, for q to warn of */
+static bool any_modified()
+{
+    for (int i = 0; i < buffer_count; i++)
+        if (i == current_buffer ? buffer.modified : buffers[i].lines.modified)
+            return true;
+
+    return false;
+}
+
+/* The bytes of line storage that go with the lines of lst: their nodes,
+ * the chunks of long lines, and their share of text they have in common
+ * with other lines. Mapped text is the file's, and not counted. */
+static size_t list_bytes(list* lst)
+{
+    size_t bytes = 0;
+
+    for (node* cur = lst->first; cur != NULL; cur = cur->next) {
+        bytes += alloc_size(node_size(cur->kind, cur->len));
+
+        if (cur->kind == T_SHARED) {
+            shared* sh = (shared*)(cur->text.ptr - offsetof(shared, text));
+
+            bytes += alloc_size(sizeof(shared) + sh->len + 1) / sh->refs;
+        } else if (cur->kind == T_PACKED) {
+            pack* pk = cur->text.packed.pack;
+
+            bytes += alloc_size(sizeof(pack) + pk->size) / pk->refs;
+        } else if (cur->kind == T_CHUNKED) {
+            rope* rp = cur->text.rope;
+
+            bytes += alloc_size(sizeof(rope)) + alloc_size(rp->cap * sizeof(chunk*)) +
+                     alloc_size(rp->cap * sizeof(size_t));
+            for (int i = 0; i < rp->count; i++)
+                bytes += alloc_size(sizeof(chunk) + rp->chunks[i]->len);
+        }
+    }
+
+    return bytes;
+}
+
+/* a line of B: the buffer's number, * for the one being edited and + if
+ * it is modified, its lines, the memory they take and its file */
+static void print_buffer(int n)
+{
+    bool here = n == current_buffer;
+    list* lst = here ? &buffer : &buffers[n].lines;
+    const char* name = here ? filename : buffers[n].filename;
+
+    fprintf(out, "%d%c%c\t%d lines\t%zu bytes\t%s\n", n + 1, here ? '*' : ' ',
+           lst->modified ? '+' : ' ', lst->length, list_bytes(lst), name != NULL ? name : "");
+}
+
+/* b: with no argument the next buffer, with a number that one, with a
+ * file name the buffer it was read into, or a new one to read it into */
+static void buffer_command(const char* arg)
+{
+    int n = current_buffer;
+
+    do
+        n = (n + 1) % buffer_count;
+    while (buffers[n].closed);
+
+    if (arg != NULL && arg[strspn(arg, "0123456789")] == 0) {
+        n = atoi(arg) - 1;
+        if (n < 0 || n >= buffer_count || buffers[n].closed) {
+            error(NO_BUF);
+            return;
+        }
+    } else if (arg != NULL) {
+        for (n = 0; n < buffer_count; n++) {
+            const char* name = n == current_buffer ? filename : buffers[n].filename;
+
+            if (name != NULL && strcmp(name, arg) == 0)
+                break;
+        }
+    }
+
+    if (n < buffer_count) {
+        switch_buffer(n);
+        print_buffer(n);
+        return;
+    }
+
+    switch_buffer(add_buffer());
+    set_filename(arg);
+    if (read_file(filename) && interactive)
+        journal_attach(filename);
+}
+
+/* m and t: lines start to end go after line cmd->dest, of the buffer
+ * cmd->dest_buf or this one, moved or copied. Copies share what text
+ * they can with the lines they are copies of. Another buffer is swapped
+ * in just for the splice. */
+static void transfer(command* cmd, int start, int end, bool move)
+{
+    int from = current_buffer;
+    int to = cmd->dest_buf > 0 ? cmd->dest_buf - 1 : from;
+    int count = end - start + 1;
+
+    if (buffer.first == NULL || start < 1 || start > end || end > buffer.length) {
+        error(ADDR);
+        return;
+    }
+
+    if (to >= buffer_count || buffers[to].closed) {
+        error(NO_BUF);
+        return;
+    }
+
+    swap_buffer(to);
+    int dest = resolve(cmd->dest);
+    bool fits = dest >= 0 && dest <= buffer.length;
+    swap_buffer(from);
+
+    // not into the middle of what is moved
+    if (!fits || (move && to == from && dest >= start && dest < end)) {
+        error(ADDR);
+        return;
+    }
+
+    // moved to where they are
+    if (move && to == from && (dest == start - 1 || dest == end)) {
+        current_line = end;
+        return;
+    }
+
+    list* lst = move ? detach_range(start, end) : copy_lines(start, end);
+
+    asked = false;
+    if (to == from) {
+        if (move && dest > end)
+            dest -= count;
+        insert_into_buffer(lst, dest);
+        current_line = dest + count;
+        return;
+    }
+
+    // each buffer's edits go to its own journal
+    journal_flush();
+    swap_buffer(to);
+    insert_into_buffer(lst, dest);
+    current_line = dest + count;
+    journal_flush();
+    swap_buffer(from);
+}
+
+/* decode a command line; returns false when it can't be parsed */
+static bool decode(char* line, command* cmd)
+{
+    cmd->name = parse(line, cmd);
+    cmd->text = NULL;
+    cmd->has_text = false;
+    cmd->span = 1;
+
+    return cmd->name != 0;
+}
+
+/* While a file loads in the background, wait for as much of it as cmd
+ * needs: all of it for $, and for . while that is still the end of what
+ * came in, else up to past the lines it names, so that they are not the
+ * last one and what a or r puts after them is not overtaken. */
+static void load_need(command* cmd)
+{
+    addr a[3] = { cmd->start, cmd->end, cmd->dest_buf == 0 ? cmd->dest : (addr){A_NONE, 0} };
+    int need = 0;
+
+    // b waits for all of it if it switches away
+    if (strchr("eqQhSbB", cmd->name) != NULL)
+        return;
+
+    // w and r default to $
+    if (strchr("wr", cmd->name) != NULL && cmd->start.kind == A_NONE)
+        need = INT_MAX;
+
+    if (a[0].kind == A_NONE)
+        a[0] = (addr){A_CURRENT, 0};
+
+    for (int i = 0; i < 3; i++) {
+        int num = a[i].kind == A_LINE ? a[i].offset :
+                  a[i].kind == A_CURRENT ? current_line + a[i].offset : 0;
+
+        if (a[i].kind == A_LAST || (a[i].kind == A_CURRENT && current_line == buffer.length))
+            need = INT_MAX;
+        else if (num >= need)
+            need = num + 1;
+    }
+
+    load_wait(need);
+}
+
+/* execute a decoded command, returns false when the editor should quit */
+/* what comes before any command: files changed under their mapping are
+ * detached from, and the lines it needs are loaded */
+static void command_start(command* cmd)
+{
+    if (maps != NULL)
+        map_check();
+
+    if (loading)
+        load_need(cmd);
+}
+
+/* what comes after any command: its journal records go out, and line
+ * storage is packed or spilled if it grew past its limits */
+static void command_done()
+{
+    if (packing)
+        schedule(IDLE_PACK);
+
+    journal_flush();
+    check_limit();
+}
+
+static bool run_command(command* cmd)
+{
+    addr start_addr = cmd->start;
+    addr end_addr = cmd->end;
+    list* text = cmd->text;
+    int w;
+
+    if (cmd->name == 0) {
+        error(cmd->fault);
+        return true;
+    }
+
+    command_start(cmd);
+
+    if (start_addr.kind == A_NONE)
+        start_addr = (addr){A_CURRENT, 0};
+
+    if (end_addr.kind == A_NONE)
+        end_addr = start_addr;
+
+    int start = resolve(start_addr);
+    if (cmd->chain)
+        current_line = start;
+    int end = resolve(end_addr);
+
+    if (start < 0 || end < 0) {
+        error(ADDR);
+        return true;
+    }
+
+    switch (cmd->name) {
+        case 'q':
+            // a save that fails leaves the buffer modified
+            save_wait(NULL);
+            if ((library ? buffer.modified : any_modified()) && !asked) {
+                error(MOD);
+                asked = true;
+            } else {
+                return false;
+            }
+            break;
+        case 'Q':
+            save_wait(NULL);
+            return false;
+        case 'e':
+            if (cmd->arg != NULL && cmd->arg[0] == '!') {
+                read_shell(0, cmd->arg + 1, true);
+                schedule(IDLE_TRIM);
+                break;
+            }
+
+            if (cmd->arg != NULL)
+                set_filename(cmd->arg);
+
+            if (filename == NULL) {
+                error(NO_FILE);
+            } else {
+                save_wait(filename);
+                if (read_file(filename) && interactive && !following)
+                    journal_attach(filename);
+            }
+            schedule(IDLE_TRIM);
+            break;
+        case 'w':
+            // the whole buffer by default
+            if (cmd->start.kind == A_NONE) {
+                start = 1;
+                end = buffer.length;
+            } else if (start < 1 || start > end || end > buffer.length) {
+                error(ADDR);
+                break;
+            }
+
+            if (cmd->arg != NULL && cmd->arg[0] == '!') {
+                write_shell(start, end, cmd->arg + 1);
+                break;
+            }
+
+            if (cmd->arg != NULL)
+                set_filename(cmd->arg);
+
+            // at the prompt the save goes on in the background
+            if (interactive) {
+                save_buffer(filename, start, end);
+                break;
+            }
+
+            write_buffer(filename, start, end);
+            if (following && filename != NULL && strcmp(filename, follow_path) == 0)
+                follow_sync();
+            break;
+        case 'r':
+            if (cmd->start.kind == A_NONE)
+                end = buffer.length;
+
+            if (cmd->arg != NULL && cmd->arg[0] == '!') {
+                if (end > buffer.length)
+                    error(ADDR);
+                else
+                    read_shell(end, cmd->arg + 1, false);
+                break;
+            }
+
+            if (cmd->arg != NULL && filename == NULL)
+                set_filename(cmd->arg);
+
+            if (cmd->arg == NULL && filename == NULL) {
+                error(NO_FILE);
+            } else {
+                save_wait(cmd->arg != NULL ? cmd->arg : filename);
+                read_into(end, cmd->arg != NULL ? cmd->arg : filename);
+            }
+            break;
+        case 'a':
+            // past the end: the block that follows is read as commands, as ed does
+            if (end > buffer.length) {
+                drop_text(text);
+                error(ADDR);
+                break;
+            }
+            if (!cmd->has_text)
+                text = text_input();
+            w = insert_into_buffer(text, end);
+            current_line = end + w;
+            break;
+        case 'i':
+            // 0i is 1i, as in ed
+            if (start > buffer.length && !(start == 1 && buffer.length == 0)) {
+                drop_text(text);
+                error(ADDR);
+                break;
+            }
+            if (start == 0)
+                start = 1;
+            if (!cmd->has_text)
+                text = text_input();
+            w = insert_into_buffer(text, start-1);
+            current_line = start-1 + w;
+            break;
+        case 'c':
+            delete_range(start, end);
+            schedule(IDLE_TRIM);
+            if (!cmd->has_text)
+                text = text_input();
+            w = insert_into_buffer(text, start-1);
+            current_line = start-1 + w;
+            break;
+        case 'n':
+            print_range(start, end, true);
+            break;
+        case 'p':
+            print_range(start, end, false);
+            break;
+        case 'd':
+            delete_range(start, end);
+            schedule(IDLE_TRIM);
+            break;
+        case 'h':
+            if (strlen(error_msg) > 0)
+                fprintf(out, "%s\n", error_msg);
+            break;
+        case 's':
+            substitute(start, end, cmd->arg);
+            break;
+        case 'S':
+            print_stats();
+            break;
+        case 'm':
+        case 't':
+            transfer(cmd, start, end, cmd->name == 'm');
+            break;
+        case 'b':
+            buffer_command(cmd->arg);
+            schedule(IDLE_TRIM);
+            break;
+        case 'B':
+            for (int i = 0; i < buffer_count; i++)
+                if (!buffers[i].closed)
+                    print_buffer(i);
+            break;
+        default:
+            error(CMD);
+    }
+
+    command_done();
+    return true;
+}
+
+/* a numeric range that can take part in a coalesced run */
+static bool fixed_range(command* cmd, int* start, int* end)
+{
+    if (cmd->start.kind != A_LINE || cmd->chain)
+        return false;
+    if (cmd->end.kind != A_LINE && cmd->end.kind != A_NONE)
+        return false;
+
+    *start = cmd->start.offset;
+    *end = cmd->end.kind == A_LINE ? cmd->end.offset : *start;
+
+    return *start >= 1 && *start <= *end;
+}
+
+/* Fold adjacent compatible commands into runs: consecutive print ranges
+ * become one output run, and deletes of adjacent ranges (in the numbering
+ * left behind by the previous delete) become a single delete. */
+static void coalesce(command* prog, int n)
+{
+    int i = 0;
+
+    while (i < n) {
+        command* head = &prog[i];
+        int start, end;
+
+        i++;
+        if (strchr("pnd", head->name) == NULL ||
+                !fixed_range(head, &head->run_start, &head->run_end))
+            continue;
+
+        while (i < n && prog[i].name == head->name &&
+                fixed_range(&prog[i], &start, &end)) {
+            if (head->name != 'd' && start == head->run_end + 1) {
+                head->run_end = end;
+            } else if (head->name == 'd' && start == head->run_start) {
+                head->run_end += end - start + 1;
+            } else if (head->name == 'd' && end == head->run_start - 1) {
+                head->run_start = start;
+            } else {
+                break;
+            }
+
+            head->span++;
+            i++;
+        }
+    }
+}
+
+/* Can the program run forward only? Addresses must be line numbers or
+ * $, and none may come before where the previous command left off:
+ * the end of a p, n or s range, the start of anything else. w may only
+ * come last, with no range, and e not at all. */
+static bool check_stream(command* prog, int n)
+{
+    int resume = 0;
+    bool written = false;
+
+    for (int i = 0; i < n; i++) {
+        command* cmd = &prog[i];
+        const char* why = NULL;
+        int start, end;
+
+        if (strchr("qQhS", cmd->name) != NULL)
+            continue;
+
+        if (cmd->name == 'w') {
+            if (cmd->start.kind != A_NONE)
+                why = "w takes no range";
+            written = true;
+        } else if (written) {
+            why = "only q may follow w";
+        } else if (cmd->name == 'e') {
+            why = "e reads a whole file";
+        } else if (strchr("mtbB", cmd->name) != NULL) {
+            why = "needs whole buffers";
+        } else if (cmd->start.kind == A_NONE || cmd->start.kind == A_CURRENT ||
+                   cmd->end.kind == A_CURRENT || (cmd->start.kind == A_LAST && cmd->start.offset != 0) ||
+                   (cmd->end.kind == A_LAST && cmd->end.offset != 0)) {
+            why = "needs line numbers or $";
+        } else {
+            start = cmd->start.kind == A_LAST ? INT_MAX : cmd->start.offset;
+            end = cmd->end.kind == A_NONE ? start : cmd->end.kind == A_LAST ? INT_MAX : cmd->end.offset;
+
+            if (start < resume)
+                why = "goes backwards";
+            else if (start > end)
+                why = error_messages[ADDR];
+            resume = strchr("pns", cmd->name) != NULL ? end : start;
+        }
+
+        if (why != NULL) {
+            fprintf(stderr, "%d: cannot stream: %s\n", cmd->lineno, why);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Pass the window's lines before line lo on to the output, and out of
+ * memory. Unless forced, the last line stays, it may turn out to be $,
+ * and lines go in batches of a window. */
+static void stream_pass(int lo, bool force)
+{
+    int n = lo - 1 - line_base;
+
+    if (n > buffer.length - !force)
+        n = buffer.length - !force;
+    if (n <= 0 || (!force && n < STREAM_WINDOW))
+        return;
+
+    node* stop = node_at(n + 1);
+
+    if (stream_out != -1 && !write_lines(stream_out, buffer.first, stop, &stream_total)) {
+        fprintf(stderr, "%s: %s\n", stream_target, strerror(errno));
+        close(stream_out);
+        stream_out = -1;
+    }
+
+    for (int i = 0; i < n; i++)
+        delete_node(buffer.first);
+
+    line_base += n;
+    current_line = current_line > n ? current_line - n : 0;
+}
+
+/* Read input into the window until it holds line hi, passing on lines
+ * before lo meanwhile; false if the input ends first. */
+static bool stream_fill(int lo, int hi)
+{
+    char* line;
+    size_t len;
+
+    while (line_base + buffer.length < hi) {
+        stream_pass(lo, false);
+
+        if ((line = reader_line(&stream_in, &len)) == NULL)
+            return false;
+
+        append_node(&buffer, new_node(line, len));
+        buffer.no_eol = stream_in.partial;
+        check_limit();
+    }
+
+    return true;
+}
+
+/* Run a p, n, s or d on lines lo to hi, INT_MAX being $, a window at a
+ * time; c deletes them. After a deleted piece the next one starts where
+ * it did. A range that runs past the end of the input stops there, with
+ * an address error. */
+static void stream_range(command* cmd, int lo, int hi)
+{
+    bool deleting = cmd->name == 'd' || cmd->name == 'c';
+    bool show = false;
+    char* shown = NULL;
+    size_t shown_len = 0;
+    bool changed = false;
+
+    while (lo <= hi) {
+        int b = hi - lo >= STREAM_WINDOW ? lo + STREAM_WINDOW - 1 : hi;
+
+        if (!stream_fill(lo, b)) {
+            b = line_base + buffer.length;
+            if (b < lo || (hi != INT_MAX && b < hi)) {
+                error(ADDR);
+                break;
+            }
+            hi = b;
+        }
+
+        command piece = *cmd;
+        piece.name = deleting ? 'd' : cmd->name;
+        piece.start = (addr){A_LINE, lo - line_base};
+        piece.end = (addr){A_LINE, b - line_base};
+        piece.chain = false;
+
+        if (cmd->name == 's') {
+            // keep the last line changed, it may be gone by the end
+            int last = subst_lines(lo - line_base, b - line_base, cmd->arg, &show);
+
+            if (last < 0)
+                break;
+            if (last > 0) {
+                node* nd = node_at(last);
+
+                changed = true;
+                current_line = last;
+                if (show) {
+                    free(shown);
+                    shown_len = nd->len;
+                    shown = malloc(shown_len + 1);
+                    memcpy(shown, line_text(nd), shown_len);
+                }
+            }
+        } else {
+            run_command(&piece);
+        }
+
+        if (deleting)
+            hi = hi == INT_MAX ? hi : hi - (b - lo + 1);
+        else
+            lo = b + 1;
+    }
+
+    if (cmd->name == 's' && !changed)
+        error(NO_MATCH);
+    if (shown != NULL) {
+        fwrite(shown, 1, shown_len, out);
+        fputc('\n', out);
+        free(shown);
+    }
+}
+
+/* run one command of a forward-only script against the window */
+static bool stream_command(command* cmd)
+{
+    if (strchr("qQhS", cmd->name) != NULL)
+        return run_command(cmd);
+
+    int start = cmd->start.kind == A_LAST ? INT_MAX : cmd->start.offset;
+    int end = cmd->end.kind == A_NONE ? start : cmd->end.kind == A_LAST ? INT_MAX : cmd->end.offset;
+
+    // $ alone: read to the end, keeping the last line
+    if (start == INT_MAX) {
+        stream_fill(INT_MAX, INT_MAX);
+        start = end = line_base + buffer.length;
+    }
+
+    if (strchr("pnsd", cmd->name) != NULL || (cmd->name == 'c' && end > start)) {
+        stream_range(cmd, start, end);
+        if (cmd->name != 'c')
+            return true;
+
+        // the rest of a c goes in where the range was
+        command piece = *cmd;
+        piece.name = 'a';
+        piece.start = piece.end = (addr){A_LINE, start - 1 - line_base};
+        return run_command(&piece);
+    }
+
+    // a single line: a, i, r or a one line c
+    if (!stream_fill(start, start)) {
+        error(ADDR);
+        return true;
+    }
+
+    command piece = *cmd;
+    piece.start = (addr){A_LINE, start - line_base};
+    piece.end = (addr){A_LINE, end - line_base};
+    piece.chain = false;
+    return run_command(&piece);
+}
+
+/* Open where the output of a streamed script goes, from its w command:
+ * a pipe for w !cmd, or a file, written beside the input and renamed
+ * over it if that is what it writes to. */
+static bool stream_open(command* w)
+{
+    struct stat src, dst;
+    const char* target = w->arg != NULL ? w->arg : filename;
+
+    if (target == NULL) {
+        error(NO_FILE);
+        return false;
+    }
+
+    stream_target = strdup(target);
+
+    if (target[0] == '!') {
+        stream_out = spawn_shell(target + 1, true, &stream_pid);
+    } else if (stat(target, &dst) == 0 && fstat(stream_in.fd, &src) == 0 &&
+               src.st_dev == dst.st_dev && src.st_ino == dst.st_ino) {
+        stream_tmp = malloc(strlen(target) + sizeof(".XXXXXX"));
+        sprintf(stream_tmp, "%s.XXXXXX", target);
+        stream_out = mkstemp(stream_tmp);
+        if (stream_out != -1)
+            fchmod(stream_out, dst.st_mode & 07777);
+    } else {
+        stream_out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+
+    if (stream_out == -1) {
+        fprintf(out, "%s: %s\n", target, strerror(errno));
+        error(target[0] == '!' ? SHELL : IFILE);
+        return false;
+    }
+
+    if (w->arg != NULL && target[0] != '!')
+        set_filename(target);
+    return true;
+}
+
+/* Run a checked forward-only program: the input is read a window at a
+ * time and lines the program is done with go straight to the output. */
+static void stream_run(command* prog, int n)
+{
+    int w = 0;
+
+    // the output is open from the start, without w lines are dropped
+    while (w < n && prog[w].name != 'w')
+        w++;
+    bool open = w < n && stream_open(&prog[w]);
+
+    for (int i = 0; i < w; i++)
+        if (!stream_command(&prog[i]))
+            return;
+
+    if (w == n)
+        return;
+
+    // w: the rest of the input goes through as it is
+    if (open) {
+        while (stream_fill(INT_MAX, line_base + buffer.length + STREAM_WINDOW))
+            ;
+        stream_pass(INT_MAX, true);
+        close(stream_out);
+
+        if (stream_pid != -1)
+            wait_shell(stream_pid);
+
+        if (stream_tmp != NULL && rename(stream_tmp, stream_target) == -1) {
+            fprintf(out, "%s: %s\n", stream_target, strerror(errno));
+            unlink(stream_tmp);
+            error(IFILE);
+        } else {
+            fprintf(out, "%zu\n", stream_total);
+            buffer.modified = false;
+        }
+    }
+
+    for (int i = w + 1; i < n; i++)
+        if (!run_command(&prog[i]))
+            return;
+}
+
+/* Batch mode: read the whole script, decode it into a program and
+ * report every parse error before anything runs. With check_only the
+ * script is decoded but never executed. */
+static int run_script(bool check_only)
+{
+    command* prog = NULL;
+    int n = 0;
+    int cap = 0;
+    int lineno = 0;
+    int errors = 0;
+    char* line;
+
+    while ((line = read_command()) != NULL) {
+        lineno++;
+
+        if (n == cap) {
+            cap = cap == 0 ? 64 : cap * 2;
+            prog = realloc(prog, cap * sizeof(command));
+        }
+
+        command* cmd = &prog[n++];
+        bool ok = decode(line, cmd);
+
+        cmd->lineno = lineno;
+        if (cmd->arg != NULL)
+            cmd->arg = strdup(cmd->arg);
+
+        if (!ok) {
+            fprintf(stderr, "%d: %s\n", lineno, error_messages[cmd->fault]);
+            errors++;
+        } else if (strchr("aic", cmd->name) != NULL) {
+            cmd->text = bulk_input();
+            cmd->has_text = true;
+            lineno += (cmd->text != NULL ? cmd->text->length : 0) + 1;
+        }
+
+        free(line);
+    }
+
+    if (errors == 0 && streaming && !check_stream(prog, n))
+        errors++;
+
+    if (errors == 0 && !check_only && streaming) {
+        sigset_t mask;
+
+        // the output may be a command that stops reading early
+        pipe_hold(&mask);
+        stream_run(prog, n);
+        pipe_release(&mask);
+    } else if (errors == 0 && !check_only) {
+        coalesce(prog, n);
+
+        for (int i = 0; i < n; i++) {
+            command* cmd = &prog[i];
+
+            if (following)
+                follow_poll();
+
+            // a run goes through the same steps as a command of its range
+            command run = *cmd;
+
+            run.start = (addr){A_LINE, cmd->run_start};
+            run.end = (addr){A_LINE, cmd->run_end};
+            if (cmd->span > 1)
+                command_start(&run);
+
+            if (cmd->span > 1 && cmd->run_end <= buffer.length) {
+                if (cmd->name == 'd') {
+                    delete_range(cmd->run_start, cmd->run_end);
+                    schedule(IDLE_TRIM);
+                } else {
+                    print_range(cmd->run_start, cmd->run_end, cmd->name == 'n');
+                }
+                command_done();
+
+                i += cmd->span - 1;
+            } else if (!run_command(cmd)) {
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        free(prog[i].arg);
+    free(prog);
+
+    return errors > 0 ? 1 : 0;
+}
+
+/* a byte count with an optional k, m or g suffix */
+static bool parse_size(const char* arg, size_t* size)
+{
+    char* end;
+    unsigned long long n = strtoull(arg, &end, 10);
+
+    if (end == arg)
+        return false;
+
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'm': case 'M': n <<= 20; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+    }
+
+    *size = n;
+    return *end == 0;
+}
+
+/* make b the buffer being edited, printing where it prints */
+static void use_buffer(em_buffer* b)
+{
+    switch_buffer(b->slot);
+    out = b->out != NULL ? b->out : null_out;
+}
+
+/* drop b's buffer and b; the lock is held */
+static void close_buffer(em_buffer* b)
+{
+    use_buffer(b);
+    journal_detach();
+    clear_buffer();
+    free(filename);
+    filename = NULL;
+    buffers[b->slot].closed = true;
+    free(b);
+}
+
+em_buffer* em_open(const char* path)
+{
+    pthread_mutex_lock(&library_lock);
+    library = true;
+
+    if (null_out == NULL && (null_out = fopen("/dev/null", "w")) == NULL) {
+        pthread_mutex_unlock(&library_lock);
+        return NULL;
+    }
+
+    em_buffer* b = calloc(1, sizeof(em_buffer));
+
+    b->slot = add_buffer();
+    use_buffer(b);
+
+    if (path != NULL) {
+        set_filename(path);
+        if (!read_file(filename)) {
+            close_buffer(b);
+            b = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&library_lock);
+    return b;
+}
+
+int em_exec(em_buffer* b, const char* script)
+{
+    const char* p = script;
+    const char* end = p + strlen(p);
+
+    pthread_mutex_lock(&library_lock);
+    use_buffer(b);
+
+    unsigned long seen = error_count;
+
+    // a q refused in an earlier script does not count for this one
+    asked = false;
+
+    while (p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        char* line = strndup(p, nl != NULL ? nl - p : end - p);
+        command cmd;
+
+        p = nl != NULL ? nl + 1 : end;
+        decode(line, &cmd);
+
+        // the text of a, i and c follows them, up to a "." line
+        if (cmd.name != 0 && strchr("aic", cmd.name) != NULL) {
+            list* lst = malloc(sizeof(list));
+            bool done;
+
+            init_list(lst);
+            p += scan_text(p, end - p, lst, &done);
+            if (!done && p < end) {
+                if (end - p != 1 || *p != '.')
+                    append_node(lst, new_node(p, end - p));
+                p = end;
+            }
+
+            if (lst->length == 0) {
+                free(lst);
+                lst = NULL;
+            }
+            cmd.text = lst;
+            cmd.has_text = true;
+        }
+
+        bool more = run_command(&cmd);
+
+        free(line);
+        if (!more)
+            break;
+    }
+
+    int r = error_count == seen ? 0 : -1;
+
+    if (r != 0)
+        b->error = error_msg;
+    pthread_mutex_unlock(&library_lock);
+    return r;
+}
+
+int em_lines(em_buffer* b)
+{
+    pthread_mutex_lock(&library_lock);
+    use_buffer(b);
+
+    int n = buffer.length;
+
+    pthread_mutex_unlock(&library_lock);
+    return n;
+}
+
+int em_each(em_buffer* b, int start, int end,
+            int (*fn)(void* ctx, const char* text, size_t len), void* ctx)
+{
+    int r = 0;
+
+    pthread_mutex_lock(&library_lock);
+    use_buffer(b);
+
+    if (start < 1 || start > end || end > buffer.length)
+        r = -1;
+
+    node* cur = r == 0 ? node_at(start) : NULL;
+
+    for (int num = start; r == 0 && num <= end; num++, cur = cur->next)
+        r = fn(ctx, line_text(cur), cur->len);
+
+    pthread_mutex_unlock(&library_lock);
+    return r;
+}
+
+int em_write(em_buffer* b, const char* path)
+{
+    pthread_mutex_lock(&library_lock);
+    use_buffer(b);
+
+    unsigned long seen = error_count;
+
+    write_buffer((char*)(path != NULL ? path : filename), 1, buffer.length);
+
+    int r = error_count == seen ? 0 : -1;
+
+    if (r != 0)
+        b->error = error_msg;
+    pthread_mutex_unlock(&library_lock);
+    return r;
+}
+
+void em_output(em_buffer* b, FILE* fp)
+{
+    b->out = fp;
+}
+
+const char* em_error(em_buffer* b)
+{
+    return b->error != NULL ? b->error : "";
+}
+
+void em_close(em_buffer* b)
+{
+    pthread_mutex_lock(&library_lock);
+    close_buffer(b);
+    pthread_mutex_unlock(&library_lock);
+}
+
+int em_main(int argc, char* argv[])
+{
+    char* line;
+    bool batch = false;
+    bool check_only = false;
+    int opt;
+    error_msg = "";
+    asked = false;
+    out = stdout;
+    map_guard();
+
+    static struct option long_options[] = {
+        {"mem-limit", required_argument, NULL, 'L'},
+        {"stream", no_argument, NULL, 'T'},
+        {"follow", no_argument, NULL, 'f'},
+        {"async", no_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "abfinz:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                async_load = true;
+                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'f':
+                following = true;
+                break;
+            case 'i':
+                interning = true;
+                break;
+            case 'z':
+                if (!parse_size(optarg, &pack_budget)) {
+                    fprintf(stderr, "%s: bad size %s\n", argv[0], optarg);
+                    return 1;
+                }
+                packing = true;
+                break;
+            case 'L':
+                if (!parse_size(optarg, &spill_limit) || spill_limit == 0) {
+                    fprintf(stderr, "%s: bad size %s\n", argv[0], optarg);
+                    return 1;
+                }
                 break;
-            case 'd':
-                delete_range(start, end);
+            case 'n':
+                batch = check_only = true;
                 break;
-            case 'h':
-                if (strlen(error_msg) > 0)
-                    printf("%s\n", error_msg);
+            case 'T':
+                batch = streaming = true;
                 break;
             default:
-                error(CMD);
+                fprintf(stderr, "usage: %s [-abfin] [-z size] [--mem-limit size] [--stream] [file]\n", argv[0]);
+                return 1;
         }
+    }
+
+    init_list(&buffer);
+    current_buffer = add_buffer();
+    interactive = isatty(STDIN_FILENO) && !batch;
+    input.fd = STDIN_FILENO;
+
+    if (interactive) {
+        init_history();
+        linenoiseSetCompletionCallback(complete);
+    }
+
+    if (streaming && following) {
+        fprintf(stderr, "%s: -f can't be used with --stream\n", argv[0]);
+        return 1;
+    }
+
+    if (streaming && optind < argc) {
+        // the file is read as the script goes
+        set_filename(argv[optind]);
+        if ((stream_in.fd = open_input(filename)) == -1)
+            return 1;
+    } else if (streaming) {
+        fprintf(stderr, "%s: --stream needs a file\n", argv[0]);
+        return 1;
+    } else if (following && optind == argc) {
+        fprintf(stderr, "%s: -f needs a file\n", argv[0]);
+        return 1;
+    } else if (optind < argc) {
+        set_filename(argv[optind]);
+        read_file(filename);
+        if (interactive && !following)
+            journal_attach(filename);
+    }
+
+    if (packing)
+        schedule(IDLE_PACK);
 
+    if (batch) {
+        int status = run_script(check_only);
+
+        load_cancel();
+        return status;
+    }
+
+    while ((line = read_command()) != NULL) {
+        command cmd;
+
+        if (following)
+            follow_poll();
+
+        decode(line, &cmd);
+        bool more = run_command(&cmd);
         free(line);
+
+        if (!more)
+            break;
     }
 
+    // a partial index is not left behind, a pending save is, and the
+    // journals are only for a session that did not end like this
+    load_cancel();
+    save_wait(NULL);
+    for (int i = 0; i < buffer_count; i++) {
+        swap_buffer(i);
+        journal_detach();
+    }
     return 0;
 }
@@ -0,0 +1,57 @@
+#ifndef EM_H
+#define EM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* em as a library: buffers read from files, edited with the commands em
+ * takes, looked at line by line and written back, all without leaving
+ * the process. It is not reentrant: the buffers share one editor, and
+ * a lock makes the calls take turns on it, so any thread can make them
+ * but a call on one buffer waits for a call on any other. Signal
+ * dispositions are left as the host set them. */
+
+#pragma GCC visibility push(default)
+
+typedef struct em_buffer em_buffer;
+
+/* read path into a new buffer, or make an empty one when path is NULL;
+ * returns NULL if the file can't be read */
+em_buffer* em_open(const char* path);
+
+/* run a script of em commands, one per line, with the text of a, i and c
+ * after them up to a "." line, as it would be piped to em; q and Q end
+ * it, q refusing only for unsaved changes to b. Returns 0, or -1 if a
+ * command failed, see em_error. */
+int em_exec(em_buffer* b, const char* script);
+
+/* the number of lines in b */
+int em_lines(em_buffer* b);
+
+/* call fn with the text and length of each of lines start to end, the
+ * first being 1; the text has no newline and is only valid during the
+ * call, and fn must not call em. Stops at a nonzero return of fn and
+ * returns it, else 0, or -1 when the lines are not all in b. */
+int em_each(em_buffer* b, int start, int end,
+            int (*fn)(void* ctx, const char* text, size_t len), void* ctx);
+
+/* write all of b to path, or its file when path is NULL; 0 or -1 */
+int em_write(em_buffer* b, const char* path);
+
+/* where b prints what em would, the lines of p, the sizes of r and w, a
+ * ? for an error; nowhere unless set */
+void em_output(em_buffer* b, FILE* fp);
+
+/* what went wrong in the last em_exec or em_write of b that failed, as
+ * h prints it */
+const char* em_error(em_buffer* b);
+
+/* free b and its lines */
+void em_close(em_buffer* b);
+
+/* the em command itself, which main.c runs */
+int em_main(int argc, char* argv[]);
+
+#pragma GCC visibility pop
+
+#endif
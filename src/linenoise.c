@@ -49,7 +49,7 @@
  * - Win32 support
  *
  * Bloat:
- * - History search like Ctrl+r in readline?
+ * - Ctrl+r history search, backed by a trigram index of the history.
  *
  * List of escape sequences used by this program, we do everything just
  * with three sequences. In order to be so cheap we may have some
@@ -89,6 +89,13 @@
  *    Sequence: ESC [ n B
  *    Effect: moves cursor down of n chars.
  *
+ * Bracketed paste mode is enabled while editing, so the terminal wraps
+ * pasted text in ESC [ 200 ~ and ESC [ 201 ~ and it can be taken in as
+ * one block instead of key by key.
+ *
+ *    Sequence: ESC [ ? 2004 h / ESC [ ? 2004 l
+ *    Effect: enable / disable bracketed paste
+ *
  * When linenoiseClearScreen() is called, two additional escape sequences
  * are used in order to clear the screen and position the cursor at home
  * position.
@@ -104,6 +111,7 @@
  */
 
 #include <termios.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -114,6 +122,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include "linenoise.h"
 
@@ -128,27 +138,27 @@ static struct termios orig_termios; /* In order to restore at exit.*/
 static int rawmode = 0; /* For atexit() function to check if restore is needed*/
 static int mlmode = 0;  /* Multi line mode. Default is single line. */
 static int atexit_registered = 0; /* Register atexit just 1 time. */
+static int cached_cols = 0; /* Terminal width, valid unless cols_invalid. */
+static volatile sig_atomic_t cols_invalid = 1; /* Set by SIGWINCH. */
+static int sigwinch_installed = 0; /* Our handler is in, old_sigwinch saved. */
+static struct sigaction old_sigwinch;
 static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
-static int history_len = 0;
+static int history_start = 0; /* Ring slot of the oldest entry. */
+static int history_len = 0;   /* Entries in use, holes included. */
+static int history_holes = 0; /* Entries removed by deduplication. */
+static int history_editing = 0; /* Newest entry is the edited line. */
 static char **history = NULL;
+static char *history_file = NULL; /* File last loaded or saved. */
+static long history_file_lines = 0; /* Lines in it, as far as we know. */
+static int history_unsaved = 0; /* Entries added since. */
 
-/* The linenoiseState structure represents the state during line editing.
- * We pass this state to functions implementing specific editing
- * functionalities. */
-struct linenoiseState {
-    int ifd;            /* Terminal stdin file descriptor. */
-    int ofd;            /* Terminal stdout file descriptor. */
-    char *buf;          /* Edited line buffer. */
-    size_t buflen;      /* Edited line buffer size. */
-    const char *prompt; /* Prompt to display. */
-    size_t plen;        /* Prompt length. */
-    size_t pos;         /* Current cursor position. */
-    size_t oldpos;      /* Previous refresh cursor position. */
-    size_t len;         /* Current edited line length. */
-    size_t cols;        /* Number of columns in terminal. */
-    size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
-    int history_index;  /* The history index we are currently editing. */
-};
+char *linenoiseEditMore = "If you see this, you are misusing the API: "
+                          "when linenoiseEditFeed() is called, if it returns "
+                          "linenoiseEditMore the user is yet editing the line. "
+                          "See linenoiseEditStart() for more information.";
+
+/* Reverse incremental search query, see linenoiseSearchKey(). */
+static char search_query[LINENOISE_MAX_LINE];
 
 enum KEY_ACTION{
 	KEY_NULL = 0,	    /* NULL */
@@ -158,6 +168,7 @@ enum KEY_ACTION{
 	CTRL_D = 4,         /* Ctrl-d */
 	CTRL_E = 5,         /* Ctrl-e */
 	CTRL_F = 6,         /* Ctrl-f */
+	CTRL_G = 7,         /* Ctrl-g */
 	CTRL_H = 8,         /* Ctrl-h */
 	TAB = 9,            /* Tab */
 	CTRL_K = 11,        /* Ctrl+k */
@@ -165,6 +176,7 @@ enum KEY_ACTION{
 	ENTER = 13,         /* Enter */
 	CTRL_N = 14,        /* Ctrl-n */
 	CTRL_P = 16,        /* Ctrl-p */
+	CTRL_R = 18,        /* Ctrl-r */
 	CTRL_T = 20,        /* Ctrl-t */
 	CTRL_U = 21,        /* Ctrl+u */
 	CTRL_W = 23,        /* Ctrl+w */
@@ -173,8 +185,17 @@ enum KEY_ACTION{
 };
 
 static void linenoiseAtExit(void);
-int linenoiseHistoryAdd(const char *line);
+static int historyPush(const char *line, size_t len, int dedupe);
+static void historyPop(void);
+static void historySet(int i, const char *line);
+static int historySlot(int i);
+static int historySearch(const char *query, size_t qlen, unsigned int before,
+                         unsigned int *seq);
 static void refreshLine(struct linenoiseState *l);
+static int linenoiseEditPaste(struct linenoiseState *l);
+static size_t linenoiseEditReserve(struct linenoiseState *l, size_t need);
+static char *linenoiseNoTTY(void);
+static int readByte(int fd, char *c);
 
 /* Debugging macro. */
 #if 0
@@ -195,6 +216,25 @@ FILE *lndebug_fp = NULL;
 #define lndebug(fmt, ...)
 #endif
 
+/* Count of bytes sent to the terminal for every key, in debug builds. */
+#ifdef LINENOISE_DEBUG
+static size_t lnstats_bytes = 0;
+#define lnstatsAdd(n) (lnstats_bytes += (n))
+#define lnstatsKey(c) \
+    do { \
+        FILE *lnstats_fp = fopen("/tmp/lndebug.txt","a"); \
+        if (lnstats_fp) { \
+            fprintf(lnstats_fp,"key %d: %d bytes\n",(int)(c), \
+                (int)lnstats_bytes); \
+            fclose(lnstats_fp); \
+        } \
+        lnstats_bytes = 0; \
+    } while (0)
+#else
+#define lnstatsAdd(n)
+#define lnstatsKey(c)
+#endif
+
 /* ======================= Low level terminal handling ====================== */
 
 /* Set if to use or not the multi line mode. */
@@ -214,6 +254,40 @@ static int isUnsupportedTerm(void) {
     return 0;
 }
 
+/* SIGWINCH handler: the cached terminal width is stale. */
+static void linenoiseSigwinch(int sig) {
+    (void)sig;
+    cols_invalid = 1;
+}
+
+/* Install the SIGWINCH handler while a line is edited, unless the
+ * program has its own. With SA_RESTART the program's reads and writes
+ * go on through a resize; poll() is still interrupted, so a caller
+ * waiting on it can redraw right away. A resize while the handler was
+ * out is not seen, so the width is asked for again each time. */
+static void installSigwinch(void) {
+    struct sigaction sa;
+
+    if (sigwinch_installed) return;
+    if (sigaction(SIGWINCH,NULL,&old_sigwinch) == -1 ||
+        old_sigwinch.sa_handler != SIG_DFL)
+        return;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = linenoiseSigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH,&sa,NULL) == -1) return;
+    sigwinch_installed = 1;
+    cols_invalid = 1;
+}
+
+/* Put back the SIGWINCH handler that was there before installSigwinch(). */
+static void removeSigwinch(void) {
+    if (!sigwinch_installed) return;
+    sigaction(SIGWINCH,&old_sigwinch,NULL);
+    sigwinch_installed = 0;
+}
+
 /* Raw mode: 1960 magic shit. */
 static int enableRawMode(int fd) {
     struct termios raw;
@@ -243,6 +317,9 @@ static int enableRawMode(int fd) {
     /* put terminal in raw mode after flushing */
     if (tcsetattr(fd,TCSAFLUSH,&raw) < 0) goto fatal;
     rawmode = 1;
+    installSigwinch();
+    /* Ask the terminal to bracket pasted text. */
+    if (write(STDOUT_FILENO,"\x1b[?2004h",8) == -1) {}
     return 0;
 
 fatal:
@@ -252,8 +329,10 @@ fatal:
 
 static void disableRawMode(int fd) {
     /* Don't even check the return value as it's too late. */
-    if (rawmode && tcsetattr(fd,TCSAFLUSH,&orig_termios) != -1)
+    if (rawmode && write(STDOUT_FILENO,"\x1b[?2004l",8) == -1) {}
+    if (rawmode && tcsetattr(fd,TCSADRAIN,&orig_termios) != -1)
         rawmode = 0;
+    removeSigwinch();
 }
 
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
@@ -283,7 +362,7 @@ static int getCursorPosition(int ifd, int ofd) {
 
 /* Try to get the number of columns in the current terminal, or assume 80
  * if it fails. */
-static int getColumns(int ifd, int ofd) {
+static int queryColumns(int ifd, int ofd) {
     struct winsize ws;
 
     if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
@@ -316,6 +395,17 @@ failed:
     return 80;
 }
 
+/* Return the terminal width, querying the terminal only when the cached
+ * value was invalidated by a resize. The query may cost two cursor
+ * position round trips when TIOCGWINSZ is not available. */
+static int getColumns(int ifd, int ofd) {
+    if (cols_invalid || cached_cols == 0) {
+        cols_invalid = 0;
+        cached_cols = queryColumns(ifd,ofd);
+    }
+    return cached_cols;
+}
+
 /* Clear the screen. Used to handle ctrl+l */
 void linenoiseClearScreen(void) {
     if (write(STDOUT_FILENO,"\x1b[H\x1b[2J",7) <= 0) {
@@ -341,64 +431,70 @@ static void freeCompletions(linenoiseCompletions *lc) {
         free(lc->cvec);
 }
 
-/* This is an helper function for linenoiseEdit() and is called when the
+/* Show the completion at 'idx' in place of the edited line, without
+ * changing the line itself. */
+static void refreshLineWithCompletion(struct linenoiseState *ls,
+                                      linenoiseCompletions *lc, size_t idx) {
+    struct linenoiseState saved = *ls;
+
+    ls->len = ls->pos = strlen(lc->cvec[idx]);
+    ls->buf = lc->cvec[idx];
+    refreshLine(ls);
+    ls->len = saved.len;
+    ls->pos = saved.pos;
+    ls->buf = saved.buf;
+}
+
+/* This is an helper function for linenoiseEditFeed() and is called when the
  * user types the <tab> key in order to complete the string currently in the
- * input.
+ * input, or types any key while completions are being shown.
  *
  * The state of the editing is encapsulated into the pointed linenoiseState
- * structure as described in the structure definition. */
-static int completeLine(struct linenoiseState *ls) {
+ * structure as described in the structure definition. The function returns
+ * the key that should still be handled as usual, or 0 if it was consumed. */
+static int completeLine(struct linenoiseState *ls, int keypressed) {
     linenoiseCompletions lc = { 0, NULL };
-    int nread, nwritten;
-    char c = 0;
+    int nwritten;
+    char c = keypressed;
 
     completionCallback(ls->buf,&lc);
     if (lc.len == 0) {
         linenoiseBeep();
+        ls->in_completion = 0;
     } else {
-        size_t stop = 0, i = 0;
-
-        while(!stop) {
-            /* Show completion or original buffer */
-            if (i < lc.len) {
-                struct linenoiseState saved = *ls;
-
-                ls->len = ls->pos = strlen(lc.cvec[i]);
-                ls->buf = lc.cvec[i];
-                refreshLine(ls);
-                ls->len = saved.len;
-                ls->pos = saved.pos;
-                ls->buf = saved.buf;
-            } else {
-                refreshLine(ls);
-            }
-
-            nread = read(ls->ifd,&c,1);
-            if (nread <= 0) {
-                freeCompletions(&lc);
-                return -1;
-            }
-
-            switch(c) {
-                case 9: /* tab */
-                    i = (i+1) % (lc.len+1);
-                    if (i == lc.len) linenoiseBeep();
-                    break;
-                case 27: /* escape */
-                    /* Re-show original buffer */
-                    if (i < lc.len) refreshLine(ls);
-                    stop = 1;
-                    break;
-                default:
-                    /* Update buffer and return */
-                    if (i < lc.len) {
-                        nwritten = snprintf(ls->buf,ls->buflen,"%s",lc.cvec[i]);
-                        ls->len = ls->pos = nwritten;
-                    }
-                    stop = 1;
-                    break;
-            }
+        switch(c) {
+            case 9: /* tab */
+                if (ls->in_completion == 0) {
+                    ls->in_completion = 1;
+                    ls->completion_idx = 0;
+                } else {
+                    ls->completion_idx = (ls->completion_idx+1) % (lc.len+1);
+                    if (ls->completion_idx == lc.len) linenoiseBeep();
+                }
+                c = 0;
+                break;
+            case 27: /* escape */
+                /* Re-show original buffer */
+                ls->in_completion = 0;
+                c = 0;
+                break;
+            default:
+                /* Update buffer and return */
+                if (ls->completion_idx < lc.len) {
+                    linenoiseEditReserve(ls,strlen(lc.cvec[ls->completion_idx]));
+                    nwritten = snprintf(ls->buf,ls->buflen,"%s",
+                                        lc.cvec[ls->completion_idx]);
+                    ls->len = ls->pos = nwritten;
+                }
+                ls->in_completion = 0;
+                break;
         }
+
+        /* Show completion or original buffer */
+        if (ls->in_completion && ls->completion_idx < lc.len)
+            refreshLineWithCompletion(ls,&lc,ls->completion_idx);
+        else
+            refreshLine(ls);
     }
 
     freeCompletions(&lc);
@@ -447,28 +543,67 @@ void linenoiseAddCompletion(linenoiseCompletions *lc, const char *str) {
 /* We define a very simple "append buffer" structure, that is an heap
  * allocated string where we can append to. This is useful in order to
  * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
+ * output in a single call, to avoid flickering effects. The buffer grows
+ * geometrically and the refresh buffer is reused across keystrokes, so in
+ * the steady state refreshing the line does not allocate at all. */
 struct abuf {
     char *b;
     int len;
+    int cap;
 };
 
+static struct abuf refresh_ab;  /* Output of the last refresh. */
+static struct abuf shown;       /* What the terminal shows (single line). */
+static struct abuf typeahead;   /* Input read past the end of a paste. */
+static int typeahead_pos = 0;
+static struct abuf pasted;      /* Pasted lines not returned yet. */
+static int pasted_pos = 0;
+
 static void abInit(struct abuf *ab) {
     ab->b = NULL;
     ab->len = 0;
+    ab->cap = 0;
 }
 
 static void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b,ab->len+len);
-
-    if (new == NULL) return;
-    memcpy(new+ab->len,s,len);
-    ab->b = new;
+    if (ab->len+len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 64;
+        char *new;
+
+        while (cap < ab->len+len) cap *= 2;
+        new = realloc(ab->b,cap);
+        if (new == NULL) return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(ab->b+ab->len,s,len);
     ab->len += len;
 }
 
+/* Empty the buffer keeping its allocation around for the next use. */
+static void abReset(struct abuf *ab) {
+    ab->len = 0;
+}
+
 static void abFree(struct abuf *ab) {
     free(ab->b);
+    abInit(ab);
+}
+
+/* Read one byte of input, taking first what was read ahead while
+ * looking for the end of a paste. */
+static int readByte(int fd, char *c) {
+    if (typeahead_pos < typeahead.len) {
+        *c = typeahead.b[typeahead_pos++];
+        return 1;
+    }
+    return read(fd,c,1);
+}
+
+/* Write to the terminal, keeping count of the bytes in debug builds. */
+static ssize_t termWrite(int fd, const void *buf, size_t len) {
+    lnstatsAdd(len);
+    return write(fd,buf,len);
 }
 
 /* Helper of refreshSingleLine() and refreshMultiLine() to show hints
@@ -495,10 +630,29 @@ void refreshShowHints(struct abuf *ab, struct linenoiseState *l, int plen) {
     }
 }
 
+/* Append the cursor movement from column 'from' to column 'to'. */
+static void abMoveCursor(struct abuf *ab, size_t from, size_t to) {
+    char seq[64];
+
+    if (to == from) return;
+    if (to == 0)
+        snprintf(seq,64,"\r");
+    else if (to > from)
+        snprintf(seq,64,"\x1b[%dC", (int)(to-from));
+    else
+        snprintf(seq,64,"\x1b[%dD", (int)(from-to));
+    abAppend(ab,seq,strlen(seq));
+}
+
 /* Single line low level line refresh.
  *
  * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
+ * cursor position, and number of columns of the terminal.
+ *
+ * When we know what the terminal currently shows only the cells that
+ * changed are sent: the cursor is moved to the first differing column,
+ * the rest of the line is written, and the tail is erased only if the
+ * line got shorter. Otherwise the whole line is redrawn. */
 static void refreshSingleLine(struct linenoiseState *l) {
     char seq[64];
     size_t plen = strlen(l->prompt);
@@ -506,7 +660,7 @@ static void refreshSingleLine(struct linenoiseState *l) {
     char *buf = l->buf;
     size_t len = l->len;
     size_t pos = l->pos;
-    struct abuf ab;
+    struct abuf *ab = &refresh_ab;
 
     while((plen+pos) >= l->cols) {
         buf++;
@@ -517,23 +671,58 @@ static void refreshSingleLine(struct linenoiseState *l) {
         len--;
     }
 
-    abInit(&ab);
-    /* Cursor to left edge */
-    snprintf(seq,64,"\r");
-    abAppend(&ab,seq,strlen(seq));
-    /* Write the prompt and the current buffer content */
-    abAppend(&ab,l->prompt,strlen(l->prompt));
-    abAppend(&ab,buf,len);
-    /* Show hits if any. */
-    refreshShowHints(&ab,l,plen);
-    /* Erase to right */
-    snprintf(seq,64,"\x1b[0K");
-    abAppend(&ab,seq,strlen(seq));
-    /* Move cursor to original position. */
-    snprintf(seq,64,"\r\x1b[%dC", (int)(pos+plen));
-    abAppend(&ab,seq,strlen(seq));
-    if (write(fd,ab.b,ab.len) == -1) {} /* Can't recover from write error. */
-    abFree(&ab);
+    abReset(ab);
+    if (l->shown_valid && !hintsCallback) {
+        size_t newlen = plen+len, same = 0, cursor = l->shown_pos;
+
+        while (same < newlen && same < (size_t)shown.len &&
+               (same < plen ? l->prompt[same] : buf[same-plen]) ==
+               shown.b[same]) same++;
+
+        if (same < newlen || same < (size_t)shown.len) {
+            abMoveCursor(ab,cursor,same);
+            if (same < plen) {
+                abAppend(ab,l->prompt+same,plen-same);
+                abAppend(ab,buf,len);
+            } else {
+                abAppend(ab,buf+(same-plen),newlen-same);
+            }
+            cursor = newlen;
+            if (newlen < (size_t)shown.len) abAppend(ab,"\x1b[0K",4);
+            /* The cursor is in the pending wrap state past the last
+             * column, only an absolute move is reliable from there. */
+            if (cursor >= l->cols) {
+                abAppend(ab,"\r",1);
+                cursor = 0;
+            }
+        }
+        abMoveCursor(ab,cursor,pos+plen);
+    } else {
+        /* Cursor to left edge */
+        snprintf(seq,64,"\r");
+        abAppend(ab,seq,strlen(seq));
+        /* Write the prompt and the current buffer content */
+        abAppend(ab,l->prompt,strlen(l->prompt));
+        abAppend(ab,buf,len);
+        /* Show hits if any. */
+        refreshShowHints(ab,l,plen);
+        /* Erase to right */
+        snprintf(seq,64,"\x1b[0K");
+        abAppend(ab,seq,strlen(seq));
+        /* Move cursor to original position. */
+        snprintf(seq,64,"\r\x1b[%dC", (int)(pos+plen));
+        abAppend(ab,seq,strlen(seq));
+    }
+
+    /* Remember what is on the screen now. With hints we don't track it as
+     * they are decorated with escape sequences. */
+    abReset(&shown);
+    abAppend(&shown,l->prompt,plen);
+    abAppend(&shown,buf,len);
+    l->shown_pos = pos+plen;
+    l->shown_valid = !hintsCallback;
+
+    if (termWrite(fd,ab->b,ab->len) == -1) {} /* Can't recover from write error. */
 }
 
 /* Multi line low level line refresh.
@@ -549,38 +738,39 @@ static void refreshMultiLine(struct linenoiseState *l) {
     int col; /* colum position, zero-based. */
     int old_rows = l->maxrows;
     int fd = l->ofd, j;
-    struct abuf ab;
+    struct abuf *ab = &refresh_ab;
 
     /* Update maxrows if needed. */
     if (rows > (int)l->maxrows) l->maxrows = rows;
+    l->shown_valid = 0;
 
     /* First step: clear all the lines used before. To do so start by
      * going to the last row. */
-    abInit(&ab);
+    abReset(ab);
     if (old_rows-rpos > 0) {
         lndebug("go down %d", old_rows-rpos);
         snprintf(seq,64,"\x1b[%dB", old_rows-rpos);
-        abAppend(&ab,seq,strlen(seq));
+        abAppend(ab,seq,strlen(seq));
     }
 
     /* Now for every row clear it, go up. */
     for (j = 0; j < old_rows-1; j++) {
         lndebug("clear+up");
         snprintf(seq,64,"\r\x1b[0K\x1b[1A");
-        abAppend(&ab,seq,strlen(seq));
+        abAppend(ab,seq,strlen(seq));
     }
 
     /* Clean the top line. */
     lndebug("clear");
     snprintf(seq,64,"\r\x1b[0K");
-    abAppend(&ab,seq,strlen(seq));
+    abAppend(ab,seq,strlen(seq));
 
     /* Write the prompt and the current buffer content */
-    abAppend(&ab,l->prompt,strlen(l->prompt));
-    abAppend(&ab,l->buf,l->len);
+    abAppend(ab,l->prompt,strlen(l->prompt));
+    abAppend(ab,l->buf,l->len);
 
     /* Show hits if any. */
-    refreshShowHints(&ab,l,plen);
+    refreshShowHints(ab,l,plen);
 
     /* If we are at the very end of the screen with our prompt, we need to
      * emit a newline and move the prompt to the first column. */
@@ -589,9 +779,9 @@ static void refreshMultiLine(struct linenoiseState *l) {
         (l->pos+plen) % l->cols == 0)
     {
         lndebug("<newline>");
-        abAppend(&ab,"\n",1);
+        abAppend(ab,"\n",1);
         snprintf(seq,64,"\r");
-        abAppend(&ab,seq,strlen(seq));
+        abAppend(ab,seq,strlen(seq));
         rows++;
         if (rows > (int)l->maxrows) l->maxrows = rows;
     }
@@ -604,7 +794,7 @@ static void refreshMultiLine(struct linenoiseState *l) {
     if (rows-rpos2 > 0) {
         lndebug("go-up %d", rows-rpos2);
         snprintf(seq,64,"\x1b[%dA", rows-rpos2);
-        abAppend(&ab,seq,strlen(seq));
+        abAppend(ab,seq,strlen(seq));
     }
 
     /* Set column. */
@@ -614,13 +804,12 @@ static void refreshMultiLine(struct linenoiseState *l) {
         snprintf(seq,64,"\r\x1b[%dC", col);
     else
         snprintf(seq,64,"\r");
-    abAppend(&ab,seq,strlen(seq));
+    abAppend(ab,seq,strlen(seq));
 
     lndebug("\n");
     l->oldpos = l->pos;
 
-    if (write(fd,ab.b,ab.len) == -1) {} /* Can't recover from write error. */
-    abFree(&ab);
+    if (termWrite(fd,ab->b,ab->len) == -1) {} /* Can't recover from write error. */
 }
 
 /* Calls the two low level functions refreshSingleLine() or
@@ -632,11 +821,28 @@ static void refreshLine(struct linenoiseState *l) {
         refreshSingleLine(l);
 }
 
+/* Make room for 'need' characters plus the nulterm when the edited line
+ * buffer belongs to linenoise, see linenoiseEditStart(). Returns the room
+ * there is, that may be less if the buffer is the caller's or if realloc()
+ * failed. */
+static size_t linenoiseEditReserve(struct linenoiseState *l, size_t need) {
+    size_t cap;
+    char *buf;
+
+    if (need <= l->buflen || !l->buf_owned) return l->buflen;
+    cap = (l->buflen+1)*2;
+    while (cap < need+1) cap *= 2;
+    if ((buf = realloc(l->buf,cap)) == NULL) return l->buflen;
+    l->buf = buf;
+    l->buflen = cap-1;
+    return l->buflen;
+}
+
 /* Insert the character 'c' at cursor current position.
  *
  * On error writing to the terminal -1 is returned, otherwise 0. */
 int linenoiseEditInsert(struct linenoiseState *l, char c) {
-    if (l->len < l->buflen) {
+    if (l->len < linenoiseEditReserve(l,l->len+1)) {
         if (l->len == l->pos) {
             l->buf[l->pos] = c;
             l->pos++;
@@ -645,7 +851,11 @@ int linenoiseEditInsert(struct linenoiseState *l, char c) {
             if ((!mlmode && l->plen+l->len < l->cols && !hintsCallback)) {
                 /* Avoid a full update of the line in the
                  * trivial case. */
-                if (write(l->ofd,&c,1) == -1) return -1;
+                if (termWrite(l->ofd,&c,1) == -1) return -1;
+                if (l->shown_valid) {
+                    abAppend(&shown,&c,1);
+                    l->shown_pos++;
+                }
             } else {
                 refreshLine(l);
             }
@@ -699,20 +909,19 @@ void linenoiseEditMoveEnd(struct linenoiseState *l) {
 #define LINENOISE_HISTORY_PREV 1
 void linenoiseEditHistoryNext(struct linenoiseState *l, int dir) {
     if (history_len > 1) {
+        int index = l->history_index;
+
         /* Update the current history entry before to
          * overwrite it with the next one. */
-        free(history[history_len - 1 - l->history_index]);
-        history[history_len - 1 - l->history_index] = strdup(l->buf);
-        /* Show the new entry */
-        l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
-        if (l->history_index < 0) {
-            l->history_index = 0;
-            return;
-        } else if (l->history_index >= history_len) {
-            l->history_index = history_len-1;
-            return;
-        }
-        strncpy(l->buf,history[history_len - 1 - l->history_index],l->buflen);
+        historySet(history_len - 1 - index, l->buf);
+        /* Show the new entry, skipping the removed ones. */
+        do {
+            index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
+            if (index < 0 || index >= history_len) return;
+        } while (history[historySlot(history_len - 1 - index)] == NULL);
+        l->history_index = index;
+        linenoiseEditReserve(l,strlen(history[historySlot(history_len - 1 - index)]));
+        strncpy(l->buf,history[historySlot(history_len - 1 - index)],l->buflen);
         l->buf[l->buflen-1] = '\0';
         l->len = l->pos = strlen(l->buf);
         refreshLine(l);
@@ -757,196 +966,537 @@ void linenoiseEditDeletePrevWord(struct linenoiseState *l) {
     refreshLine(l);
 }
 
-/* This function is the core of the line editing capability of linenoise.
- * It expects 'fd' to be already in "raw mode" so that every key pressed
- * will be returned ASAP to read().
+/* Insert a block of text at the cursor with a single refresh. */
+static void linenoiseEditInsertBlock(struct linenoiseState *l, const char *s,
+                                     size_t n) {
+    if (n > linenoiseEditReserve(l,l->len+n)-l->len) n = l->buflen-l->len;
+    memmove(l->buf+l->pos+n,l->buf+l->pos,l->len-l->pos);
+    memcpy(l->buf+l->pos,s,n);
+    l->pos += n;
+    l->len += n;
+    l->buf[l->len] = '\0';
+    refreshLine(l);
+}
+
+/* Take in a bracketed paste, after its ESC [ 200 ~ start marker.
  *
- * The resulting string is put into 'buf' when the user type enter, or
- * when ctrl+d is typed.
+ * The payload is read in blocks up to the end marker, with line breaks
+ * normalized to \n. Text up to the first line break is inserted at the
+ * cursor. When there is more, the rest is kept for the next calls to
+ * linenoise(), or for the caller to take as a whole with
+ * linenoisePasted(), the pasted lines are echoed with a single write and
+ * ENTER is returned so the current line is submitted. Otherwise 0 is
+ * returned and editing goes on. */
+static int linenoiseEditPaste(struct linenoiseState *l) {
+    static const char endmark[] = "\x1b[201~";
+    struct abuf p;
+    char *end = NULL, *nl;
+    int j, k, more;
+
+    abInit(&p);
+    while (end == NULL) {
+        char chunk[4096];
+        int n, from = p.len > 5 ? p.len-5 : 0;
+
+        if (typeahead_pos < typeahead.len) {
+            n = typeahead.len-typeahead_pos;
+            if (n > (int)sizeof(chunk)) n = sizeof(chunk);
+            memcpy(chunk,typeahead.b+typeahead_pos,n);
+            typeahead_pos += n;
+        } else {
+            n = read(l->ifd,chunk,sizeof(chunk));
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                abFree(&p);
+                return -1;
+            }
+        }
+        abAppend(&p,chunk,n);
+        for (j = from; j+6 <= p.len && end == NULL; j++)
+            if (p.b[j] == '\x1b' && memcmp(p.b+j,endmark,6) == 0)
+                end = p.b+j;
+    }
+
+    /* Keep what was typed after the paste for later. */
+    abReset(&typeahead);
+    abAppend(&typeahead,end+6,p.len-(end+6-p.b));
+    typeahead_pos = 0;
+    p.len = end-p.b;
+
+    /* Terminals send \r for line breaks, make them \n. */
+    for (j = k = 0; j < p.len; j++) {
+        if (p.b[j] == '\r') {
+            p.b[k++] = '\n';
+            if (j+1 < p.len && p.b[j+1] == '\n') j++;
+        } else {
+            p.b[k++] = p.b[j];
+        }
+    }
+    p.len = k;
+
+    nl = memchr(p.b,'\n',p.len);
+    more = nl != NULL;
+    linenoiseEditInsertBlock(l,p.b,more ? (size_t)(nl-p.b) : (size_t)p.len);
+    if (more) {
+        struct abuf echo;
+        char *s = nl+1, *e = p.b+p.len;
+
+        /* Drop what was already returned and queue the new lines. */
+        memmove(pasted.b,pasted.b+pasted_pos,pasted.len-pasted_pos);
+        pasted.len -= pasted_pos;
+        pasted_pos = 0;
+        abAppend(&pasted,s,e-s);
+
+        /* Show the complete lines now, the last partial one will be
+         * drawn by the edit that continues it. */
+        abInit(&echo);
+        while ((nl = memchr(s,'\n',e-s)) != NULL) {
+            abAppend(&echo,"\r\n",2);
+            abAppend(&echo,l->prompt,l->plen);
+            abAppend(&echo,s,nl-s);
+            s = nl+1;
+        }
+        if (echo.len && termWrite(l->ofd,echo.b,echo.len) == -1) {}
+        abFree(&echo);
+    }
+    abFree(&p);
+    return more ? ENTER : 0;
+}
+
+/* Show the current search match with the search prompt. */
+static void refreshSearch(struct linenoiseState *l) {
+    char prompt[LINENOISE_MAX_LINE+32];
+    struct linenoiseState saved = *l;
+    const char *match = l->search_slot == -1 ? "" : history[l->search_slot];
+    char *hit = l->search_slot == -1 ? NULL : strstr(match,search_query);
+
+    snprintf(prompt,sizeof(prompt),"(%sreverse-i-search)`%s': ",
+             l->search_failed ? "failing " : "",search_query);
+    l->prompt = prompt;
+    l->plen = strlen(prompt);
+    l->buf = (char*)match;
+    l->len = strlen(match);
+    l->pos = hit ? (size_t)(hit-match) : 0;
+    refreshLine(l);
+    l->prompt = saved.prompt;
+    l->plen = saved.plen;
+    l->buf = saved.buf;
+    l->len = saved.len;
+    l->pos = saved.pos;
+}
+
+/* Incremental reverse history search, entered with Ctrl+r. Every key
+ * typed narrows the match, Ctrl+r again looks for an older one, and
+ * backspace widens the query again. Enter accepts and submits the match,
+ * Ctrl+g or Ctrl+c restore the original line, any other key accepts the
+ * match for further editing.
  *
- * The function returns the length of the current buffer. */
-static int linenoiseEdit(int stdin_fd, int stdout_fd, char *buf, size_t buflen, const char *prompt)
-{
-    struct linenoiseState l;
+ * Called with each key while l->in_search is set. Returns ENTER when the
+ * line should be submitted and 0 to continue editing. */
+static int linenoiseSearchKey(struct linenoiseState *l, char c) {
+    size_t qlen = l->search_len;
+
+    if (!l->in_search) {
+        l->in_search = 1;
+        l->search_len = 0;
+        l->search_seq = 0;
+        l->search_slot = -1;
+        l->search_failed = 0;
+        search_query[0] = '\0';
+        refreshSearch(l);
+        return 0;
+    }
+
+    switch(c) {
+    case CTRL_R:
+        if (l->search_slot != -1) {
+            unsigned int older;
+            int s = historySearch(search_query,qlen,l->search_seq,&older);
+            if (s != -1) {
+                l->search_slot = s;
+                l->search_seq = older;
+            } else {
+                l->search_failed = 1;
+                linenoiseBeep();
+            }
+        }
+        break;
+    case BACKSPACE:
+    case CTRL_H:
+        if (qlen == 0) break;
+        search_query[--qlen] = '\0';
+        l->search_len = qlen;
+        l->search_slot = historySearch(search_query,qlen,~0u,&l->search_seq);
+        l->search_failed = qlen && l->search_slot == -1;
+        break;
+    case CTRL_G:
+    case CTRL_C:
+        l->in_search = 0;
+        refreshLine(l);
+        return 0;
+    default:
+        if ((unsigned char)c >= 32 && qlen < sizeof(search_query)-1) {
+            unsigned int from = l->search_slot == -1 ? ~0u : l->search_seq+1;
+            int s;
+
+            search_query[qlen++] = c;
+            search_query[qlen] = '\0';
+            l->search_len = qlen;
+            /* The current match is still the best if it matches. */
+            s = historySearch(search_query,qlen,from,&l->search_seq);
+            if (s != -1) l->search_slot = s;
+            l->search_failed = s == -1;
+            break;
+        }
+        /* Any other key accepts the match. */
+        if (l->search_slot != -1) {
+            const char *match = history[l->search_slot];
+            char *hit = strstr(match,search_query);
+
+            linenoiseEditReserve(l,strlen(match));
+            strncpy(l->buf,match,l->buflen);
+            l->buf[l->buflen-1] = '\0';
+            l->len = strlen(l->buf);
+            l->pos = hit ? (size_t)(hit-match) : l->len;
+        }
+        l->in_search = 0;
+        refreshLine(l);
+        return c == ENTER ? ENTER : 0;
+    }
+    refreshSearch(l);
+    return 0;
+}
 
+/* This function is part of the multiplexed API of linenoise, that is used
+ * in order to implement the blocking variant of the API but can also be
+ * called by the user directly in an event driven program. It will:
+ *
+ * 1. Initialize the linenoise state passed by the user.
+ * 2. Put the terminal in RAW mode.
+ * 3. Show the prompt.
+ * 4. Return control to the user, that will have to call linenoiseEditFeed()
+ *    each time there is some data arriving in the standard input.
+ *
+ * The user can also call linenoiseEditHide() and linenoiseEditShow() if it
+ * is required to show some input arriving asynchronously, without mixing
+ * it with the currently edited line.
+ *
+ * When linenoiseEditFeed() returns non-NULL, the user finished with the
+ * line editing session (pressed enter CTRL-D/C): in this case the caller
+ * needs to call linenoiseEditStop() to put back the terminal in normal
+ * mode. This will not destroy the buffer, as long as the linenoiseState
+ * is still valid in the context of the caller.
+ *
+ * If buf is NULL linenoise allocates the buffer itself, starting with
+ * buflen bytes, and grows it as needed so that lines are only limited by
+ * memory. It is released by linenoiseEditStop().
+ *
+ * The function returns 0 on success, or -1 if writing to standard output
+ * or allocating the buffer fails. If stdin_fd or stdout_fd are set to -1, the default is to use
+ * STDIN_FILENO and STDOUT_FILENO.
+ */
+int linenoiseEditStart(struct linenoiseState *l, int stdin_fd, int stdout_fd, char *buf, size_t buflen, const char *prompt) {
     /* Populate the linenoise state that we pass to functions implementing
      * specific editing functionalities. */
-    l.ifd = stdin_fd;
-    l.ofd = stdout_fd;
-    l.buf = buf;
-    l.buflen = buflen;
-    l.prompt = prompt;
-    l.plen = strlen(prompt);
-    l.oldpos = l.pos = 0;
-    l.len = 0;
-    l.cols = getColumns(stdin_fd, stdout_fd);
-    l.maxrows = 0;
-    l.history_index = 0;
+    l->in_completion = 0;
+    l->in_search = 0;
+    l->ifd = stdin_fd != -1 ? stdin_fd : STDIN_FILENO;
+    l->ofd = stdout_fd != -1 ? stdout_fd : STDOUT_FILENO;
+    l->buf_owned = buf == NULL;
+    if (l->buf_owned) {
+        if (buflen < 2) buflen = 2;
+        if ((buf = malloc(buflen)) == NULL) return -1;
+    }
+    l->buf = buf;
+    l->buflen = buflen;
+    l->prompt = prompt;
+    l->plen = strlen(prompt);
+    l->oldpos = l->pos = 0;
+    l->len = 0;
+    l->maxrows = 0;
+    l->history_index = 0;
+    l->shown_valid = 0;
 
     /* Buffer starts empty. */
-    l.buf[0] = '\0';
-    l.buflen--; /* Make sure there is always space for the nulterm */
+    l->buf[0] = '\0';
+    l->buflen--; /* Make sure there is always space for the nulterm */
+
+    /* If stdin is not a tty, stop here with the initialization. We
+     * will actually just read a line from standard input in blocking
+     * mode later, in linenoiseEditFeed(). */
+    if (!isatty(l->ifd)) return 0;
+
+    /* Enter raw mode. */
+    if (enableRawMode(l->ifd) == -1) return -1;
+    l->cols = getColumns(l->ifd, l->ofd);
 
     /* The latest history entry is always our current buffer, that
      * initially is just an empty string. */
-    linenoiseHistoryAdd("");
+    if (historyPush("",0,0)) history_editing = 1;
+
+    if (write(l->ofd,prompt,l->plen) == -1) return -1;
+    abReset(&shown);
+    abAppend(&shown,prompt,l->plen);
+    l->shown_pos = l->plen;
+    l->shown_valid = l->plen < l->cols;
+
+    /* Continue the partial last line of a paste. */
+    if (pasted_pos < pasted.len) {
+        linenoiseEditInsertBlock(l,pasted.b+pasted_pos,pasted.len-pasted_pos);
+        abReset(&pasted);
+        pasted_pos = 0;
+    }
+    return 0;
+}
 
-    if (write(l.ofd,prompt,l.plen) == -1) return -1;
-    while(1) {
-        char c;
-        int nread;
-        char seq[3];
-
-        nread = read(l.ifd,&c,1);
-        if (nread <= 0) return l.len;
-
-        /* Only autocomplete when the callback is set. It returns < 0 when
-         * there was an error reading from fd. Otherwise it will return the
-         * character that should be handled next. */
-        if (c == 9 && completionCallback != NULL) {
-            c = completeLine(&l);
-            /* Return on errors */
-            if (c < 0) return l.len;
-            /* Read next character when 0 */
-            if (c == 0) continue;
-        }
+/* This function is part of the multiplexed API of linenoise, see the top
+ * comment on linenoiseEditStart() for more information. Call this function
+ * each time there is some data to read from the standard input file
+ * descriptor, or after poll() was interrupted by a terminal resize. In the
+ * case of blocking operations, this function can just be called in a loop,
+ * and block.
+ *
+ * The function returns linenoiseEditMore to signal that line editing is
+ * still in progress, that is, the user didn't yet pressed enter / CTRL-D.
+ * Otherwise the function returns the pointer to the heap-allocated buffer
+ * with the edited line, that the user should free with linenoiseFree().
+ *
+ * On special conditions, NULL is returned and errno is populated:
+ *
+ * EAGAIN if the user pressed Ctrl-C
+ * ENOENT if the user pressed Ctrl-D
+ *
+ * Some other errno: I/O error.
+ */
+char *linenoiseEditFeed(struct linenoiseState *l) {
+    char c;
+    int nread;
+    char seq[3];
+
+    /* Not a TTY, pass control to line reading without character
+     * count limits. */
+    if (!isatty(l->ifd)) return linenoiseNoTTY();
+
+    if (linenoiseEditResized(l)) return linenoiseEditMore;
+
+    nread = readByte(l->ifd,&c);
+    if (nread == -1 && errno == EINTR) return linenoiseEditMore;
+    if (nread <= 0) return NULL;
+
+    /* Only autocomplete when the callback is set. It returns the
+     * character that should be handled next, or 0 if it was consumed. */
+    if ((l->in_completion || c == 9) && completionCallback != NULL) {
+        c = completeLine(l,c);
+        /* Read next character when 0 */
+        if (c == 0) return linenoiseEditMore;
+    }
 
-        switch(c) {
-        case ENTER:    /* enter */
-            history_len--;
-            free(history[history_len]);
-            if (mlmode) linenoiseEditMoveEnd(&l);
-            if (hintsCallback) {
-                /* Force a refresh without hints to leave the previous
-                 * line as the user typed it after a newline. */
-                linenoiseHintsCallback *hc = hintsCallback;
-                hintsCallback = NULL;
-                refreshLine(&l);
-                hintsCallback = hc;
-            }
-            return (int)l.len;
-        case CTRL_C:     /* ctrl-c */
-            errno = EAGAIN;
-            return -1;
-        case BACKSPACE:   /* backspace */
-        case 8:     /* ctrl-h */
-            linenoiseEditBackspace(&l);
-            break;
-        case CTRL_D:     /* ctrl-d, remove char at right of cursor, or if the
-                            line is empty, act as end-of-file. */
-            if (l.len > 0) {
-                linenoiseEditDelete(&l);
-            } else {
-                history_len--;
-                free(history[history_len]);
-                return -1;
-            }
-            break;
-        case CTRL_T:    /* ctrl-t, swaps current character with previous. */
-            if (l.pos > 0 && l.pos < l.len) {
-                int aux = buf[l.pos-1];
-                buf[l.pos-1] = buf[l.pos];
-                buf[l.pos] = aux;
-                if (l.pos != l.len-1) l.pos++;
-                refreshLine(&l);
-            }
-            break;
-        case CTRL_B:     /* ctrl-b */
-            linenoiseEditMoveLeft(&l);
-            break;
-        case CTRL_F:     /* ctrl-f */
-            linenoiseEditMoveRight(&l);
-            break;
-        case CTRL_P:    /* ctrl-p */
-            linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
-            break;
-        case CTRL_N:    /* ctrl-n */
-            linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
-            break;
-        case ESC:    /* escape sequence */
-            /* Read the next two bytes representing the escape sequence.
-             * Use two calls to handle slow terminals returning the two
-             * chars at different times. */
-            if (read(l.ifd,seq,1) == -1) break;
-            if (read(l.ifd,seq+1,1) == -1) break;
-
-            /* ESC [ sequences. */
-            if (seq[0] == '[') {
-                if (seq[1] >= '0' && seq[1] <= '9') {
-                    /* Extended escape, read additional byte. */
-                    if (read(l.ifd,seq+2,1) == -1) break;
-                    if (seq[2] == '~') {
-                        switch(seq[1]) {
-                        case '3': /* Delete key. */
-                            linenoiseEditDelete(&l);
-                            break;
-                        }
-                    }
-                } else {
-                    switch(seq[1]) {
-                    case 'A': /* Up */
-                        linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
-                        break;
-                    case 'B': /* Down */
-                        linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
-                        break;
-                    case 'C': /* Right */
-                        linenoiseEditMoveRight(&l);
-                        break;
-                    case 'D': /* Left */
-                        linenoiseEditMoveLeft(&l);
-                        break;
-                    case 'H': /* Home */
-                        linenoiseEditMoveHome(&l);
+    /* Reverse incremental search, returns ENTER when the match
+     * was accepted and submitted. */
+    if (l->in_search || (c == CTRL_R && history_len > 1)) {
+        c = linenoiseSearchKey(l,c);
+        if (c == 0) return linenoiseEditMore;
+    }
+
+    switch(c) {
+    case ENTER:    /* enter */
+        if (mlmode) linenoiseEditMoveEnd(l);
+        if (hintsCallback) {
+            /* Force a refresh without hints to leave the previous
+             * line as the user typed it after a newline. */
+            linenoiseHintsCallback *hc = hintsCallback;
+            hintsCallback = NULL;
+            refreshLine(l);
+            hintsCallback = hc;
+        }
+        return strdup(l->buf);
+    case CTRL_C:     /* ctrl-c */
+        errno = EAGAIN;
+        return NULL;
+    case BACKSPACE:   /* backspace */
+    case 8:     /* ctrl-h */
+        linenoiseEditBackspace(l);
+        break;
+    case CTRL_D:     /* ctrl-d, remove char at right of cursor, or if the
+                        line is empty, act as end-of-file. */
+        if (l->len > 0) {
+            linenoiseEditDelete(l);
+        } else {
+            errno = ENOENT;
+            return NULL;
+        }
+        break;
+    case CTRL_T:    /* ctrl-t, swaps current character with previous. */
+        if (l->pos > 0 && l->pos < l->len) {
+            int aux = l->buf[l->pos-1];
+            l->buf[l->pos-1] = l->buf[l->pos];
+            l->buf[l->pos] = aux;
+            if (l->pos != l->len-1) l->pos++;
+            refreshLine(l);
+        }
+        break;
+    case CTRL_B:     /* ctrl-b */
+        linenoiseEditMoveLeft(l);
+        break;
+    case CTRL_F:     /* ctrl-f */
+        linenoiseEditMoveRight(l);
+        break;
+    case CTRL_P:    /* ctrl-p */
+        linenoiseEditHistoryNext(l, LINENOISE_HISTORY_PREV);
+        break;
+    case CTRL_N:    /* ctrl-n */
+        linenoiseEditHistoryNext(l, LINENOISE_HISTORY_NEXT);
+        break;
+    case ESC:    /* escape sequence */
+        /* Read the next two bytes representing the escape sequence.
+         * Use two calls to handle slow terminals returning the two
+         * chars at different times. */
+        if (readByte(l->ifd,seq) == -1) break;
+        if (readByte(l->ifd,seq+1) == -1) break;
+
+        /* ESC [ sequences. */
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                /* Extended escape, read the rest of the number. */
+                int num = seq[1]-'0';
+
+                while (1) {
+                    if (readByte(l->ifd,seq+2) <= 0) break;
+                    if (seq[2] < '0' || seq[2] > '9' || num > 999) break;
+                    num = num*10 + seq[2]-'0';
+                }
+                if (seq[2] == '~') {
+                    switch(num) {
+                    case 3: /* Delete key. */
+                        linenoiseEditDelete(l);
                         break;
-                    case 'F': /* End*/
-                        linenoiseEditMoveEnd(&l);
+                    case 200: /* Bracketed paste. */
+                        c = linenoiseEditPaste(l);
+                        if (c == -1) return NULL;
+                        if (c == ENTER) return strdup(l->buf);
                         break;
                     }
                 }
-            }
-
-            /* ESC O sequences. */
-            else if (seq[0] == 'O') {
+            } else {
                 switch(seq[1]) {
+                case 'A': /* Up */
+                    linenoiseEditHistoryNext(l, LINENOISE_HISTORY_PREV);
+                    break;
+                case 'B': /* Down */
+                    linenoiseEditHistoryNext(l, LINENOISE_HISTORY_NEXT);
+                    break;
+                case 'C': /* Right */
+                    linenoiseEditMoveRight(l);
+                    break;
+                case 'D': /* Left */
+                    linenoiseEditMoveLeft(l);
+                    break;
                 case 'H': /* Home */
-                    linenoiseEditMoveHome(&l);
+                    linenoiseEditMoveHome(l);
                     break;
                 case 'F': /* End*/
-                    linenoiseEditMoveEnd(&l);
+                    linenoiseEditMoveEnd(l);
                     break;
                 }
             }
-            break;
-        default:
-            if (linenoiseEditInsert(&l,c)) return -1;
-            break;
-        case CTRL_U: /* Ctrl+u, delete the whole line. */
-            buf[0] = '\0';
-            l.pos = l.len = 0;
-            refreshLine(&l);
-            break;
-        case CTRL_K: /* Ctrl+k, delete from current to end of line. */
-            buf[l.pos] = '\0';
-            l.len = l.pos;
-            refreshLine(&l);
-            break;
-        case CTRL_A: /* Ctrl+a, go to the start of the line */
-            linenoiseEditMoveHome(&l);
-            break;
-        case CTRL_E: /* ctrl+e, go to the end of the line */
-            linenoiseEditMoveEnd(&l);
-            break;
-        case CTRL_L: /* ctrl+l, clear screen */
-            linenoiseClearScreen();
-            refreshLine(&l);
-            break;
-        case CTRL_W: /* ctrl+w, delete previous word */
-            linenoiseEditDeletePrevWord(&l);
-            break;
         }
+
+        /* ESC O sequences. */
+        else if (seq[0] == 'O') {
+            switch(seq[1]) {
+            case 'H': /* Home */
+                linenoiseEditMoveHome(l);
+                break;
+            case 'F': /* End*/
+                linenoiseEditMoveEnd(l);
+                break;
+            }
+        }
+        break;
+    default:
+        if (linenoiseEditInsert(l,c)) return NULL;
+        break;
+    case CTRL_U: /* Ctrl+u, delete the whole line. */
+        l->buf[0] = '\0';
+        l->pos = l->len = 0;
+        refreshLine(l);
+        break;
+    case CTRL_K: /* Ctrl+k, delete from current to end of line. */
+        l->buf[l->pos] = '\0';
+        l->len = l->pos;
+        refreshLine(l);
+        break;
+    case CTRL_A: /* Ctrl+a, go to the start of the line */
+        linenoiseEditMoveHome(l);
+        break;
+    case CTRL_E: /* ctrl+e, go to the end of the line */
+        linenoiseEditMoveEnd(l);
+        break;
+    case CTRL_L: /* ctrl+l, clear screen */
+        linenoiseClearScreen();
+        l->shown_valid = 0;
+        refreshLine(l);
+        break;
+    case CTRL_W: /* ctrl+w, delete previous word */
+        linenoiseEditDeletePrevWord(l);
+        break;
+    }
+    lnstatsKey(c);
+    return linenoiseEditMore;
+}
+
+/* This is part of the multiplexed linenoise API. See linenoiseEditStart()
+ * for more information. This function is called when linenoiseEditFeed()
+ * returns something different than NULL. At this point the user input
+ * is in the buffer, and we can restore the terminal in normal mode. */
+void linenoiseEditStop(struct linenoiseState *l) {
+    if (l->buf_owned) {
+        free(l->buf);
+        l->buf = NULL;
+        l->buf_owned = 0;
+    }
+    if (!isatty(l->ifd)) return;
+    if (history_editing) historyPop();
+    disableRawMode(l->ifd);
+    printf("\n");
+}
+
+/* Return 1 if keys were already read, past the end of a paste, and are
+ * waiting for linenoiseEditFeed(): a caller polling the terminal won't
+ * see them there. */
+int linenoiseEditPending(struct linenoiseState *l) {
+    (void)l;
+    return typeahead_pos < typeahead.len;
+}
+
+/* Redraw the line for the new width if the terminal was resized since
+ * it was last drawn. Returns 1 if it was. A caller waiting for input on
+ * its own calls this when the wait is interrupted by the signal. */
+int linenoiseEditResized(struct linenoiseState *l) {
+    if (!cols_invalid || !isatty(l->ifd)) return 0;
+    l->cols = getColumns(l->ifd, l->ofd);
+    l->shown_valid = 0;
+    if (l->in_search) refreshSearch(l);
+    else refreshLine(l);
+    return 1;
+}
+
+/* Hide the line being edited, so that the caller can write something
+ * else on the terminal, and linenoiseEditShow() it again after. */
+void linenoiseEditHide(struct linenoiseState *l) {
+    if (mlmode) {
+        refreshMultiLine(l);    /* Reposition the cursor first. */
+        if (write(l->ofd,"\r\x1b[0K",5) == -1) {}
+    } else {
+        if (write(l->ofd,"\r\x1b[0K",5) == -1) {}
     }
-    return l.len;
+    l->shown_valid = 0;
+}
+
+/* Show the line again after linenoiseEditHide(). */
+void linenoiseEditShow(struct linenoiseState *l) {
+    if (l->in_search) refreshSearch(l);
+    else refreshLine(l);
 }
 
 /* This special mode is used by linenoise in order to print scan codes
@@ -977,21 +1527,26 @@ void linenoisePrintKeyCodes(void) {
     disableRawMode(STDIN_FILENO);
 }
 
-/* This function calls the line editing function linenoiseEdit() using
- * the STDIN file descriptor set in raw mode. */
-static int linenoiseRaw(char *buf, size_t buflen, const char *prompt) {
-    int count;
+/* This just implements a blocking loop for the multiplexed API.
+ * In many applications that are not event-driven, we can just call
+ * the blocking linenoise API, wait for the user to complete the editing
+ * and return the buffer. */
+static char *linenoiseBlockingEdit(int stdin_fd, int stdout_fd, char *buf, size_t buflen, const char *prompt)
+{
+    struct linenoiseState l;
 
-    if (buflen == 0) {
+    /* Editing without a buffer is invalid. */
+    if (buf != NULL && buflen == 0) {
         errno = EINVAL;
-        return -1;
+        return NULL;
     }
 
-    if (enableRawMode(STDIN_FILENO) == -1) return -1;
-    count = linenoiseEdit(STDIN_FILENO, STDOUT_FILENO, buf, buflen, prompt);
-    disableRawMode(STDIN_FILENO);
-    printf("\n");
-    return count;
+    if (linenoiseEditStart(&l,stdin_fd,stdout_fd,buf,buflen,prompt) == -1)
+        return NULL;
+    char *res;
+    while((res = linenoiseEditFeed(&l)) == linenoiseEditMore);
+    linenoiseEditStop(&l);
+    return res;
 }
 
 /* This function is called when linenoise() is called with the standard
@@ -1037,7 +1592,11 @@ static char *linenoiseNoTTY(void) {
  * something even in the most desperate of the conditions. */
 char *linenoise(const char *prompt) {
     char buf[LINENOISE_MAX_LINE];
-    int count;
+    char *line;
+
+    /* Complete lines left over from a paste are returned as they are,
+     * they were already shown. */
+    if ((line = linenoisePastedLine()) != NULL) return line;
 
     if (!isatty(STDIN_FILENO)) {
         /* Not a tty: read from file / pipe. In this mode we don't want any
@@ -1056,9 +1615,8 @@ char *linenoise(const char *prompt) {
         }
         return strdup(buf);
     } else {
-        count = linenoiseRaw(buf,LINENOISE_MAX_LINE,prompt);
-        if (count == -1) return NULL;
-        return strdup(buf);
+        /* Let linenoise grow the buffer, long lines are fine too. */
+        return linenoiseBlockingEdit(STDIN_FILENO,STDOUT_FILENO,NULL,LINENOISE_MAX_LINE,prompt);
     }
 }
 
@@ -1070,97 +1628,503 @@ void linenoiseFree(void *ptr) {
     free(ptr);
 }
 
+/* Return the text of a paste that was not returned as lines yet and set
+ * '*len' to its length, or return NULL if there is none. This lets the
+ * caller take in a large paste as a block instead of line by line. */
+const char *linenoisePasted(size_t *len) {
+    if (pasted_pos >= pasted.len) return NULL;
+    *len = pasted.len-pasted_pos;
+    return pasted.b+pasted_pos;
+}
+
+/* Return the next complete line left over from a paste, or NULL if there
+ * is none. The line was already shown and should not be edited again. */
+char *linenoisePastedLine(void) {
+    char *nl, *line;
+
+    if (pasted_pos >= pasted.len) return NULL;
+    nl = memchr(pasted.b+pasted_pos,'\n',pasted.len-pasted_pos);
+    if (nl == NULL) return NULL;
+    line = strndup(pasted.b+pasted_pos,nl-(pasted.b+pasted_pos));
+    pasted_pos = nl+1-pasted.b;
+    return line;
+}
+
+/* Mark 'len' bytes of the text returned by linenoisePasted() as used. */
+void linenoisePastedConsume(size_t len) {
+    pasted_pos += len;
+    if (pasted_pos >= pasted.len) {
+        abReset(&pasted);
+        pasted_pos = 0;
+    }
+}
+
 /* ================================ History ================================= */
 
-/* Free the history, but does not reset it. Only used when we have to
- * exit() to avoid memory leaks are reported by valgrind & co. */
-static void freeHistory(void) {
-    if (history) {
-        int j;
+/* The history is a circular buffer of history_max_len slots, of which the
+ * history_len starting at history_start are in use, oldest first. When a
+ * line is added again its older copy is removed, leaving a NULL hole that
+ * navigation skips; holes are squeezed out once they fill half the ring.
+ *
+ * Every entry but the line being edited is also in an open addressing
+ * hash table keyed by its contents, so duplicates are found in O(1) no
+ * matter how large the history is. */
+struct historyBucket {
+    unsigned int hash;
+    int slot;           /* Ring slot of the entry, -1 if empty. */
+};
 
-        for (j = 0; j < history_len; j++)
-            free(history[j]);
-        free(history);
+static struct historyBucket *history_hash = NULL;
+static unsigned int history_hash_mask = 0;
+
+/* For Ctrl+r every indexed entry gets a sequence number, and its trigrams
+ * are hashed into buckets of postings in sequence order. A search walks
+ * the shortest bucket among the query trigrams from the newest posting,
+ * checking candidates with strstr(). Postings of entries that were since
+ * removed are recognized by their stale sequence number and dropped
+ * lazily when a bucket fills up. */
+#define HISTORY_TRIGRAM_BUCKETS 65536
+
+struct historyPosting {
+    int slot;
+    unsigned int seq;
+};
+
+struct historyPostings {
+    struct historyPosting *p;
+    int len;
+    int cap;
+};
+
+static struct historyPostings *history_trigrams = NULL;
+static unsigned int *history_seq = NULL; /* Per slot, 0 if not indexed. */
+static unsigned int history_next_seq = 1;
+
+/* Queries shorter than a trigram scan the history from the newest entry,
+ * but skip whole blocks of ring slots using a summary of the bytes and
+ * (hashed) byte pairs found in the block. Summaries only ever gain bits
+ * as entries are added; removing one marks its block for a rebuild. */
+#define HISTORY_BLOCK 64
+
+struct historyBlock {
+    unsigned long long bytes[4];
+    unsigned long long pairs[4];
+    int dirty;
+};
+
+static struct historyBlock *history_blocks = NULL;
+
+/* Hash of a history line: 32 bit FNV-1a. */
+static unsigned int historyHashLine(const char *s, size_t len) {
+    unsigned int h = 2166136261u;
+    size_t j;
+
+    for (j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619u;
     }
+    return h;
 }
 
-/* At exit we'll try to fix the terminal to the initial conditions. */
-static void linenoiseAtExit(void) {
-    disableRawMode(STDIN_FILENO);
-    freeHistory();
+/* Ring slot of the logical entry 'i', where 0 is the oldest one. */
+static int historySlot(int i) {
+    return (history_start+i) % history_max_len;
 }
 
-/* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-int linenoiseHistoryAdd(const char *line) {
+/* Is the logical entry 'i' the line currently being edited? That one is
+ * scratch space and never indexed. */
+static int historyIsScratch(int i) {
+    return history_editing && i == history_len-1;
+}
+
+/* Find the ring slot holding 'line', or -1. */
+static int historyFind(const char *line, size_t len) {
+    unsigned int h = historyHashLine(line,len);
+    unsigned int j = h & history_hash_mask;
+
+    if (history_hash == NULL) return -1;
+    while (history_hash[j].slot != -1) {
+        int slot = history_hash[j].slot;
+        if (history_hash[j].hash == h && strlen(history[slot]) == len &&
+            memcmp(history[slot],line,len) == 0) return slot;
+        j = (j+1) & history_hash_mask;
+    }
+    return -1;
+}
+
+static unsigned int historyTrigram(const char *s) {
+    unsigned int t = ((unsigned char)s[0] << 16) |
+                     ((unsigned char)s[1] << 8) | (unsigned char)s[2];
+    return (t * 2654435761u) >> 16 & (HISTORY_TRIGRAM_BUCKETS-1);
+}
+
+/* Add a posting for the entry in 'slot' to a trigram bucket. */
+static void historyPost(struct historyPostings *b, int slot) {
+    unsigned int seq = history_seq[slot];
+
+    /* The same entry may hash here more than once. */
+    if (b->len && b->p[b->len-1].seq == seq) return;
+    if (b->len == b->cap) {
+        int j, live = 0;
+
+        /* Drop postings of removed entries before growing. */
+        for (j = 0; j < b->len; j++)
+            if (history_seq[b->p[j].slot] == b->p[j].seq)
+                b->p[live++] = b->p[j];
+        b->len = live;
+        if (b->len*4 >= b->cap*3) {
+            int cap = b->cap ? b->cap*2 : 4;
+            struct historyPosting *p = realloc(b->p,sizeof(*p)*cap);
+
+            if (p == NULL) return;
+            b->p = p;
+            b->cap = cap;
+        }
+    }
+    b->p[b->len].slot = slot;
+    b->p[b->len].seq = seq;
+    b->len++;
+}
+
+#define BLOCK_SET(bits,n) ((bits)[((n)>>6)&3] |= 1ULL << ((n)&63))
+#define BLOCK_HAS(bits,n) ((bits)[((n)>>6)&3] & (1ULL << ((n)&63)))
+#define BLOCK_PAIR(s) (((unsigned char)(s)[0]*31+(unsigned char)(s)[1]) & 255)
+
+static void historyBlockAdd(struct historyBlock *bk, const char *line) {
+    size_t j;
+
+    for (j = 0; line[j]; j++) {
+        BLOCK_SET(bk->bytes,(unsigned char)line[j]);
+        if (line[j+1]) BLOCK_SET(bk->pairs,BLOCK_PAIR(line+j));
+    }
+}
+
+/* Recompute the summary of a block from the entries it holds. */
+static void historyBlockRebuild(int block) {
+    struct historyBlock *bk = &history_blocks[block];
+    int slot;
+
+    memset(bk,0,sizeof(*bk));
+    for (slot = block*HISTORY_BLOCK;
+         slot < (block+1)*HISTORY_BLOCK && slot < history_max_len; slot++)
+        if (history_seq[slot]) historyBlockAdd(bk,history[slot]);
+}
+
+/* Can the block hold an entry containing 'query'? */
+static int historyBlockMatches(struct historyBlock *bk, const char *query,
+                               size_t qlen) {
+    size_t j;
+
+    for (j = 0; j < qlen; j++) {
+        if (!BLOCK_HAS(bk->bytes,(unsigned char)query[j])) return 0;
+        if (j+1 < qlen && !BLOCK_HAS(bk->pairs,BLOCK_PAIR(query+j))) return 0;
+    }
+    return 1;
+}
+
+static void historyIndex(int slot) {
+    const char *line = history[slot];
+    size_t len = strlen(line), j;
+    unsigned int h = historyHashLine(line,len);
+    unsigned int k = h & history_hash_mask;
+
+    while (history_hash[k].slot != -1) k = (k+1) & history_hash_mask;
+    history_hash[k].hash = h;
+    history_hash[k].slot = slot;
+
+    history_seq[slot] = history_next_seq++;
+    historyBlockAdd(&history_blocks[slot/HISTORY_BLOCK],line);
+    for (j = 0; j+3 <= len; j++)
+        historyPost(&history_trigrams[historyTrigram(line+j)],slot);
+}
+
+/* Remove a slot from the hash table. With linear probing the following
+ * buckets of the cluster are shifted back so lookups never stop early. */
+static void historyUnindex(int slot) {
+    unsigned int h = historyHashLine(history[slot],strlen(history[slot]));
+    unsigned int i = h & history_hash_mask, j;
+
+    history_seq[slot] = 0;
+    history_blocks[slot/HISTORY_BLOCK].dirty = 1;
+    while (history_hash[i].slot != slot) {
+        if (history_hash[i].slot == -1) return;
+        i = (i+1) & history_hash_mask;
+    }
+    j = i;
+    while (1) {
+        unsigned int k;
+
+        j = (j+1) & history_hash_mask;
+        if (history_hash[j].slot == -1) break;
+        k = history_hash[j].hash & history_hash_mask;
+        /* Move the entry back unless its home bucket lies in (i,j]. */
+        if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            history_hash[i] = history_hash[j];
+            i = j;
+        }
+    }
+    history_hash[i].slot = -1;
+}
+
+/* (Re)build the hash table and the trigram index for the current ring. */
+static int historyRehash(void) {
+    unsigned int size = 16, j;
+    int i;
+
+    while (size < (unsigned int)history_max_len*2) size *= 2;
+    free(history_hash);
+    history_hash = malloc(sizeof(*history_hash)*size);
+    if (history_hash == NULL) return -1;
+    history_hash_mask = size-1;
+    for (j = 0; j < size; j++) history_hash[j].slot = -1;
+
+    free(history_seq);
+    history_seq = calloc(history_max_len,sizeof(*history_seq));
+    if (history_seq == NULL) return -1;
+    free(history_blocks);
+    history_blocks = calloc(history_max_len/HISTORY_BLOCK+1,
+                            sizeof(*history_blocks));
+    if (history_blocks == NULL) return -1;
+    if (history_trigrams == NULL) {
+        history_trigrams = calloc(HISTORY_TRIGRAM_BUCKETS,
+                                  sizeof(*history_trigrams));
+        if (history_trigrams == NULL) return -1;
+    }
+    for (j = 0; j < HISTORY_TRIGRAM_BUCKETS; j++)
+        history_trigrams[j].len = 0;
+    for (i = 0; i < history_len; i++) {
+        int slot = historySlot(i);
+        if (history[slot] && !historyIsScratch(i)) historyIndex(slot);
+    }
+    return 0;
+}
+
+/* Copy the live entries of the history, oldest first, into a fresh ring
+ * of 'len' slots, keeping only the newest ones if they don't fit. */
+static int historyResize(int len) {
+    char **new = calloc(len,sizeof(char*));
+    int i, j = len;
+
+    if (new == NULL) return -1;
+    for (i = history_len-1; i >= 0; i--) {
+        char *entry = history[historySlot(i)];
+
+        if (entry == NULL) continue;
+        if (j > 0)
+            new[--j] = entry;
+        else
+            free(entry);
+    }
+    memmove(new,new+j,sizeof(char*)*(len-j));
+    free(history);
+    history = new;
+    history_max_len = len;
+    history_start = 0;
+    history_len = len-j;
+    history_holes = 0;
+    return historyRehash();
+}
+
+/* Drop the newest entry, used for the line being edited. */
+static void historyPop(void) {
+    int slot = historySlot(history_len-1);
+
+    if (history[slot] == NULL)
+        history_holes--;
+    else if (!historyIsScratch(history_len-1))
+        historyUnindex(slot);
+    free(history[slot]);
+    history[slot] = NULL;
+    history_len--;
+    history_editing = 0;
+}
+
+/* Replace the text of the logical entry 'i'. */
+static void historySet(int i, const char *line) {
+    int slot = historySlot(i);
+    int indexed = !historyIsScratch(i);
+
+    if (indexed) historyUnindex(slot);
+    free(history[slot]);
+    history[slot] = strdup(line);
+    if (history[slot] == NULL) {
+        history[slot] = strdup("");
+        if (history[slot] == NULL) return;
+    }
+    if (indexed) historyIndex(slot);
+}
+
+/* Add a copy of 'line' as the newest entry. With 'dedupe' set an older
+ * copy of the same line is removed first, and the entry is indexed. */
+static int historyPush(const char *line, size_t len, int dedupe) {
     char *linecopy;
+    int slot;
 
     if (history_max_len == 0) return 0;
 
     /* Initialization on first call. */
     if (history == NULL) {
-        history = malloc(sizeof(char*)*history_max_len);
+        history = calloc(history_max_len,sizeof(char*));
         if (history == NULL) return 0;
-        memset(history,0,(sizeof(char*)*history_max_len));
+        if (historyRehash() == -1) return 0;
     }
 
-    /* Don't add duplicated lines. */
-    if (history_len && !strcmp(history[history_len-1], line)) return 0;
+    if (dedupe && (slot = historyFind(line,len)) != -1) {
+        /* Already the newest entry: nothing to do. */
+        if (slot == historySlot(history_len-1)) return 0;
+        historyUnindex(slot);
+        free(history[slot]);
+        history[slot] = NULL;
+        history_holes++;
+    }
 
-    /* Add an heap allocated copy of the line in the history.
-     * If we reached the max length, remove the older line. */
-    linecopy = strdup(line);
+    linecopy = malloc(len+1);
     if (!linecopy) return 0;
+    memcpy(linecopy,line,len);
+    linecopy[len] = '\0';
+
+    /* If we reached the max length, remove the oldest line. */
     if (history_len == history_max_len) {
-        free(history[0]);
-        memmove(history,history+1,sizeof(char*)*(history_max_len-1));
+        slot = historySlot(0);
+        if (history[slot] == NULL) {
+            history_holes--;
+        } else {
+            historyUnindex(slot);
+            free(history[slot]);
+            history[slot] = NULL;
+        }
+        history_start = (history_start+1) % history_max_len;
         history_len--;
     }
-    history[history_len] = linecopy;
+    slot = historySlot(history_len);
+    history[slot] = linecopy;
     history_len++;
+    if (dedupe) {
+        historyIndex(slot);
+        history_unsaved++;
+    }
+
+    /* Squeeze out the holes once they fill half of the ring. */
+    if (history_holes > history_max_len/2) historyResize(history_max_len);
     return 1;
 }
 
+/* Find the newest entry containing 'query' that was indexed before the
+ * sequence number 'before'. Returns its ring slot and sets '*seq', or
+ * returns -1. Short queries have no trigram to look up and scan the
+ * history from the newest entry, which ends early as they match a lot. */
+static int historySearch(const char *query, size_t qlen, unsigned int before,
+                         unsigned int *seq) {
+    struct historyPostings *b = NULL;
+    size_t j;
+    int i;
+
+    if (qlen == 0 || history == NULL) return -1;
+    if (qlen < 3) {
+        for (i = history_len-1; i >= 0; i--) {
+            int slot = historySlot(i);
+            int block = slot/HISTORY_BLOCK;
+            unsigned int s = history_seq[slot];
+
+            if (history_blocks[block].dirty) historyBlockRebuild(block);
+            if (!historyBlockMatches(&history_blocks[block],query,qlen)) {
+                /* Going back from here the ring slots decrease down to
+                 * the start of the block before they can wrap. */
+                i -= slot % HISTORY_BLOCK;
+                continue;
+            }
+            if (s == 0 || s >= before) continue;
+            if (strstr(history[slot],query)) {
+                *seq = s;
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    for (j = 0; j+3 <= qlen; j++) {
+        struct historyPostings *t = &history_trigrams[historyTrigram(query+j)];
+        if (b == NULL || t->len < b->len) b = t;
+    }
+
+    /* Postings are in sequence order: skip the newer ones. */
+    {
+        int lo = 0, hi = b->len;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (b->p[mid].seq < before) lo = mid+1; else hi = mid;
+        }
+        i = lo-1;
+    }
+    for (; i >= 0; i--) {
+        struct historyPosting *p = &b->p[i];
+
+        if (history_seq[p->slot] != p->seq) continue;
+        if (strstr(history[p->slot],query)) {
+            *seq = p->seq;
+            return p->slot;
+        }
+    }
+    return -1;
+}
+
+/* Free the history, but does not reset it. Only used when we have to
+ * exit() to avoid memory leaks are reported by valgrind & co. */
+static void freeHistory(void) {
+    if (history) {
+        int j;
+
+        for (j = 0; j < history_len; j++)
+            free(history[historySlot(j)]);
+        free(history);
+    }
+    if (history_trigrams) {
+        int j;
+
+        for (j = 0; j < HISTORY_TRIGRAM_BUCKETS; j++)
+            free(history_trigrams[j].p);
+        free(history_trigrams);
+    }
+    free(history_hash);
+    free(history_seq);
+    free(history_blocks);
+    free(history_file);
+}
+
+/* At exit we'll try to fix the terminal to the initial conditions. */
+static void linenoiseAtExit(void) {
+    disableRawMode(STDIN_FILENO);
+    freeHistory();
+    abFree(&refresh_ab);
+    abFree(&shown);
+    abFree(&typeahead);
+    abFree(&pasted);
+}
+
+/* This is the API call to add a new entry in the linenoise history.
+ * Adding a line that is already in the history moves it to the most
+ * recent position. Both adding and evicting the oldest entry when the
+ * history is full are O(1), so huge histories are fine. */
+int linenoiseHistoryAdd(const char *line) {
+    return historyPush(line,strlen(line),1);
+}
+
 /* Set the maximum length for the history. This function can be called even
  * if there is already some history, the function will make sure to retain
  * just the latest 'len' elements if the new history length value is smaller
  * than the amount of items already inside the history. */
 int linenoiseHistorySetMaxLen(int len) {
-    char **new;
-
     if (len < 1) return 0;
     if (history) {
-        int tocopy = history_len;
-
-        new = malloc(sizeof(char*)*len);
-        if (new == NULL) return 0;
-
-        /* If we can't copy everything, free the elements we'll not use. */
-        if (len < tocopy) {
-            int j;
-
-            for (j = 0; j < tocopy-len; j++) free(history[j]);
-            tocopy = len;
-        }
-        memset(new,0,sizeof(char*)*len);
-        memcpy(new,history+(history_len-tocopy), sizeof(char*)*tocopy);
-        free(history);
-        history = new;
+        if (historyResize(len) == -1) return 0;
+    } else {
+        history_max_len = len;
     }
-    history_max_len = len;
-    if (history_len > history_max_len)
-        history_len = history_max_len;
     return 1;
 }
 
-/* Save the history in the specified file. On success 0 is returned
- * otherwise -1 is returned. */
-int linenoiseHistorySave(const char *filename) {
+/* Rewrite the whole history file. */
+static int historyRewrite(const char *filename) {
     mode_t old_umask = umask(S_IXUSR|S_IRWXG|S_IRWXO);
     FILE *fp;
     int j;
@@ -1169,31 +2133,120 @@ int linenoiseHistorySave(const char *filename) {
     umask(old_umask);
     if (fp == NULL) return -1;
     chmod(filename,S_IRUSR|S_IWUSR);
-    for (j = 0; j < history_len; j++)
-        fprintf(fp,"%s\n",history[j]);
+    history_file_lines = 0;
+    for (j = 0; j < history_len; j++) {
+        char *entry = history[historySlot(j)];
+        if (entry == NULL) continue;
+        fprintf(fp,"%s\n",entry);
+        history_file_lines++;
+    }
     fclose(fp);
     return 0;
 }
 
+/* Append the entries added since the file was last loaded or saved with
+ * a single write, so concurrent sessions sharing the file interleave
+ * whole lines. */
+static int historyAppend(const char *filename) {
+    struct abuf ab;
+    int fd, j, first = history_len-history_unsaved, ok;
+
+    if (history_unsaved == 0) return 0;
+    if (first < 0) first = 0;
+    fd = open(filename,O_WRONLY|O_APPEND|O_CREAT,S_IRUSR|S_IWUSR);
+    if (fd == -1) return -1;
+    abInit(&ab);
+    for (j = first; j < history_len; j++) {
+        char *entry = history[historySlot(j)];
+        if (entry == NULL) continue;
+        abAppend(&ab,entry,strlen(entry));
+        abAppend(&ab,"\n",1);
+        history_file_lines++;
+    }
+    ok = ab.len == 0 || write(fd,ab.b,ab.len) == ab.len;
+    abFree(&ab);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/* Save the history in the specified file. On success 0 is returned
+ * otherwise -1 is returned.
+ *
+ * Once the history was loaded from or saved to a file, later saves to the
+ * same file only append the new entries. The file is compacted when it
+ * grows past twice the history size: it is reloaded, so entries appended
+ * by other sessions are kept, and rewritten without duplicates. */
+int linenoiseHistorySave(const char *filename) {
+    int ret;
+
+    if (history_file == NULL || strcmp(history_file,filename) != 0) {
+        ret = historyRewrite(filename);
+    } else if (history_file_lines+history_unsaved <= 2L*history_max_len) {
+        ret = historyAppend(filename);
+    } else {
+        if (historyAppend(filename) == -1) return -1;
+        while (history_len) historyPop();
+        history_start = history_holes = 0;
+        if (linenoiseHistoryLoad(filename) == -1) return -1;
+        ret = historyRewrite(filename);
+    }
+    if (ret == 0) {
+        if (history_file != filename) {
+            free(history_file);
+            history_file = strdup(filename);
+        }
+        history_unsaved = 0;
+    }
+    return ret;
+}
+
 /* Load the history from the specified file. If the file does not exist
  * zero is returned and no operation is performed.
  *
  * If the file exists and the operation succeeded 0 is returned, otherwise
- * on error -1 is returned. */
+ * on error -1 is returned. The file is mapped and split in place, so
+ * lines have no length limit and nothing is copied but the entries. */
 int linenoiseHistoryLoad(const char *filename) {
-    FILE *fp = fopen(filename,"r");
-    char buf[LINENOISE_MAX_LINE];
+    int fd = open(filename,O_RDONLY);
+    struct stat st;
+    char *map = NULL, *p, *end;
+    long lines = 0;
+
+    if (fd == -1) return -1;
+    if (fstat(fd,&st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
 
-    if (fp == NULL) return -1;
+    p = map;
+    end = map+st.st_size;
+    while (p < end) {
+        char *nl = memchr(p,'\n',end-p);
+        char *cr;
+        size_t len;
 
-    while (fgets(buf,LINENOISE_MAX_LINE,fp) != NULL) {
-        char *p;
+        if (nl == NULL) nl = end;
+        len = nl-p;
+        if ((cr = memchr(p,'\r',len)) != NULL) len = cr-p;
+        historyPush(p,len,1);
+        lines++;
+        p = nl+1;
+    }
+    if (map) munmap(map,st.st_size);
 
-        p = strchr(buf,'\r');
-        if (!p) p = strchr(buf,'\n');
-        if (p) *p = '\0';
-        linenoiseHistoryAdd(buf);
+    if (history_file != filename) {
+        free(history_file);
+        history_file = strdup(filename);
     }
-    fclose(fp);
+    history_file_lines = lines;
+    history_unsaved = 0;
     return 0;
 }
@@ -43,6 +43,39 @@
 extern "C" {
 #endif
 
+#include <stddef.h> /* For size_t. */
+
+extern char *linenoiseEditMore;
+
+/* The linenoiseState structure represents the state during line editing.
+ * We pass this state to functions implementing specific editing
+ * functionalities. */
+struct linenoiseState {
+    int in_completion;  /* The user pressed TAB and we are now in completion
+                           mode, so input is handled by completeLine(). */
+    size_t completion_idx; /* Index of next completion to propose. */
+    int in_search;      /* Ctrl+r was pressed, input goes to the search. */
+    size_t search_len;  /* Length of the search query. */
+    unsigned int search_seq; /* Age of the current search match. */
+    int search_slot;    /* History slot of the match, -1 if none. */
+    int search_failed;  /* The last search key found nothing. */
+    int ifd;            /* Terminal stdin file descriptor. */
+    int ofd;            /* Terminal stdout file descriptor. */
+    char *buf;          /* Edited line buffer. */
+    size_t buflen;      /* Edited line buffer size. */
+    int buf_owned;      /* buf was allocated by linenoise and may grow. */
+    const char *prompt; /* Prompt to display. */
+    size_t plen;        /* Prompt length. */
+    size_t pos;         /* Current cursor position. */
+    size_t oldpos;      /* Previous refresh cursor position. */
+    size_t len;         /* Current edited line length. */
+    size_t cols;        /* Number of columns in terminal. */
+    size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
+    int history_index;  /* The history index we are currently editing. */
+    int shown_valid;    /* Does 'shown' match the terminal? (single line) */
+    size_t shown_pos;   /* Column of the cursor on the terminal. */
+};
+
 typedef struct linenoiseCompletions {
   size_t len;
   char **cvec;
@@ -56,8 +89,21 @@ void linenoiseSetHintsCallback(linenoiseHintsCallback *);
 void linenoiseSetFreeHintsCallback(linenoiseFreeHintsCallback *);
 void linenoiseAddCompletion(linenoiseCompletions *, const char *);
 
+/* Non blocking API. */
+int linenoiseEditStart(struct linenoiseState *l, int stdin_fd, int stdout_fd, char *buf, size_t buflen, const char *prompt);
+char *linenoiseEditFeed(struct linenoiseState *l);
+void linenoiseEditStop(struct linenoiseState *l);
+void linenoiseEditHide(struct linenoiseState *l);
+void linenoiseEditShow(struct linenoiseState *l);
+int linenoiseEditResized(struct linenoiseState *l);
+int linenoiseEditPending(struct linenoiseState *l);
+
+/* Blocking API. */
 char *linenoise(const char *prompt);
 void linenoiseFree(void *ptr);
+char *linenoisePastedLine(void);
+const char *linenoisePasted(size_t *len);
+void linenoisePastedConsume(size_t len);
 int linenoiseHistoryAdd(const char *line);
 int linenoiseHistorySetMaxLen(int len);
 int linenoiseHistorySave(const char *filename);
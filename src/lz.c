@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* Every sequence starts with a token: literal count in the high nibble,
+ * match length minus LZ_MIN_MATCH in the low one. A nibble of 15 is
+ * followed by bytes adding to it until one is below 255. Then come the
+ * literals, a 2 byte little endian offset and the match length bytes.
+ * The last sequence has literals only. */
+
+static unsigned lz_hash(const unsigned char* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* write the extra bytes of a length that did not fit in its nibble */
+static unsigned char* put_length(unsigned char* op, unsigned char* oend, size_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op == oend)
+            return NULL;
+        *op++ = 255;
+    }
+
+    if (op == oend)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+static unsigned char* put_sequence(unsigned char* op, unsigned char* oend,
+                                   const unsigned char* lit, size_t nlit,
+                                   size_t offset, size_t match)
+{
+    size_t mlen = match != 0 ? match - LZ_MIN_MATCH : 0;
+
+    if (op == oend)
+        return NULL;
+
+    *op++ = (nlit < 15 ? nlit : 15) << 4 | (mlen < 15 ? mlen : 15);
+
+    if (nlit >= 15 && (op = put_length(op, oend, nlit - 15)) == NULL)
+        return NULL;
+
+    if ((size_t)(oend - op) < nlit)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (match == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    if (mlen >= 15 && (op = put_length(op, oend, mlen - 15)) == NULL)
+        return NULL;
+
+    return op;
+}
+
+size_t lz_compress(const void* src, size_t n, void* dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+    const unsigned char* in = src;
+    const unsigned char* ip = in;
+    const unsigned char* anchor = in;
+    const unsigned char* end = in + n;
+    unsigned char* op = dst;
+    unsigned char* oend = op + cap;
+
+    while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        unsigned h = lz_hash(ip);
+        const unsigned char* ref = in + table[h];
+
+        table[h] = ip - in;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        size_t len = LZ_MIN_MATCH;
+
+        while (ip + len < end && ref[len] == ip[len])
+            len++;
+
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+        if (op == NULL)
+            return 0;
+
+        ip += len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+
+    return op - (unsigned char*)dst;
+}
+
+/* add the extra bytes of a length; false if the input runs out */
+static bool get_length(const unsigned char** ip, const unsigned char* iend, size_t* len)
+{
+    unsigned b;
+
+    do {
+        if (*ip == iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+
+    return true;
+}
+
+size_t lz_decompress(const void* src, size_t n, void* dst, size_t cap)
+{
+    const unsigned char* ip = src;
+    const unsigned char* iend = ip + n;
+    unsigned char* op = dst;
+    unsigned char* oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        size_t match = token & 15;
+
+        if (nlit == 15 && !get_length(&ip, iend, &nlit))
+            return 0;
+
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+            return 0;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return 0;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        if (match == 15 && !get_length(&ip, iend, &match))
+            return 0;
+        match += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)dst) ||
+            (size_t)(oend - op) < match)
+            return 0;
+
+        // byte by byte, the match may overlap what it copies
+        const unsigned char* ref = op - offset;
+        for (size_t i = 0; i < match; i++)
+            op[i] = ref[i];
+        op += match;
+    }
+
+    return op - (unsigned char*)dst;
+}
@@ -0,0 +1,18 @@
+#ifndef EM_LZ_H
+#define EM_LZ_H
+
+#include <stddef.h>
+
+/* A small LZ77 codec in the LZ4 mould: byte aligned sequences of literals
+ * followed by a back reference, no entropy coding. Fast enough to run on
+ * every access to a cold block of lines. */
+
+/* compress n bytes of src into dst; returns the compressed size, or 0 if
+ * it does not fit in cap bytes */
+size_t lz_compress(const void* src, size_t n, void* dst, size_t cap);
+
+/* decompress n bytes of src into dst; returns the decompressed size, or 0
+ * if the input is malformed or does not fit in cap bytes */
+size_t lz_decompress(const void* src, size_t n, void* dst, size_t cap);
+
+#endif
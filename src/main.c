@@ -0,0 +1,6 @@
+#include "em.h"
+
+int main(int argc, char* argv[])
+{
+    return em_main(argc, argv);
+}